@@ -0,0 +1,442 @@
+#! /usr/bin/perl -w
+
+# bench.pl
+#    This program benchmarks io61 against the stdio, syscall, and slow
+#    versions over a matrix of parameters. Each configuration runs for
+#    several trials; the report gives the median time, a 95% confidence
+#    interval, throughput, and system call counts, as CSV or JSON.
+#
+#    Usage: perl bench.pl [NAME=VALUE]...
+#    Parameters can also be set in the environment:
+#
+#    PROGRAMS    Test programs to run (default blockcat61,stridecat61,
+#                reverse61,cat61)
+#    VARIANTS    Implementations: io61, stdio, syscall, slow (default
+#                io61,stdio)
+#    BLOCKSIZES  Values for `-b`, for programs that take it (default
+#                1,4096,65536)
+#    STRIDES     Values for `-t`, for programs that take it (default 1024)
+#    SIZES       Input file sizes (default 1m,16m)
+#    CACHE       Page cache state before each trial: warm, cold (default
+#                warm,cold)
+#    TRANSPORT   Where output goes: file, or socket to run the program
+#                under `./socketpipe`, sending its output over a TCP
+#                loopback socket to the same variant of blockcat61
+#                (default file)
+#    SOCKBUFS    Socket buffer sizes for TRANSPORT=socket, passed to
+#                `socketpipe -B`; 0 means the system default (default
+#                0,65536,1048576)
+#    TRIALS      Trials per configuration (default 5)
+#    MAXTIME     Time limit per trial in seconds (default 20)
+#    FORMAT      csv or json (default csv)
+#    OUT         Output file (default standard output)
+#    STRACE      Count file I/O system calls (read, write, lseek, and
+#                their positioned and vectored forms) for every variant
+#                with `strace -c`: 1, 0, or auto, meaning 1 if strace is
+#                installed (default auto). Without strace, only io61 rows
+#                get counts, taken from io61's own statistics; the
+#                `syscalls_source` column says which source each row used
+#    NOMAKE      If 1, don't build missing programs
+
+use Time::HiRes;
+use POSIX;
+use List::Util qw(sum);
+sub first (@) { return $_[0]; }
+
+sub nonemptyenv ($) {
+    my ($e) = @_;
+    return exists($ENV{$e}) && $ENV{$e} ne "" && $ENV{$e} ne " ";
+}
+
+eval { require "syscall.ph" };
+
+my (%param) = (
+    "PROGRAMS" => "blockcat61,stridecat61,reverse61,cat61",
+    "VARIANTS" => "io61,stdio",
+    "BLOCKSIZES" => "1,4096,65536",
+    "STRIDES" => "1024",
+    "SIZES" => "1m,16m",
+    "CACHE" => "warm,cold",
+    "TRANSPORT" => "file",
+    "SOCKBUFS" => "0,65536,1048576",
+    "TRIALS" => 5,
+    "MAXTIME" => 20,
+    "FORMAT" => "csv",
+    "OUT" => "-",
+    "STRACE" => "auto",
+    "NOMAKE" => 0
+);
+foreach my $k (keys %param) {
+    $param{$k} = $ENV{$k} if nonemptyenv($k);
+}
+while (@ARGV) {
+    if ($ARGV[0] =~ /\A([A-Z]+)=(.*)\z/s && exists($param{$1})) {
+        $param{$1} = $2;
+    } else {
+        print STDERR "Usage: perl bench.pl [NAME=VALUE]...\n";
+        exit(1);
+    }
+    shift @ARGV;
+}
+$param{"TRIALS"} = 5 if int($param{"TRIALS"}) <= 0;
+$param{"MAXTIME"} = 20 if $param{"MAXTIME"} <= 0;
+die "*** FORMAT must be csv or json\n" if $param{"FORMAT"} !~ /\A(?:csv|json)\z/;
+die "*** TRANSPORT must be file or socket\n"
+    if grep { !/\A(?:file|socket)\z/ } split(/[\s,]+/, $param{"TRANSPORT"});
+
+my ($STRACE) = $param{"STRACE"} ? first(grep {-x $_} ("/usr/bin/strace", "/bin/strace")) : undef;
+die "*** STRACE=1 but strace is not installed\n"
+    if !$STRACE && $param{"STRACE"} eq "1";
+if (!$STRACE && grep { $_ ne "io61" } split(/[\s,]+/, $param{"VARIANTS"})) {
+    print STDERR "*** strace not used; the syscalls column is empty for non-io61 variants\n";
+}
+my ($COMMIT) = `git rev-parse --short HEAD 2>/dev/null` || "";
+chomp($COMMIT);
+
+sub split_param ($) {
+    return grep { $_ ne "" } split(/[\s,]+/, $param{$_[0]});
+}
+
+
+# parse_size(str)
+#    Parses a size like `64k`, `16m`, or `1g` into bytes.
+
+sub parse_size ($) {
+    my ($s) = @_;
+    die "*** $s: bad size\n" if $s !~ /\A(\d+)([kmg]?)\z/i;
+    my ($n, $unit) = ($1, lc($2));
+    $n *= 1024 if $unit eq "k";
+    $n *= 1024 * 1024 if $unit eq "m";
+    $n *= 1024 * 1024 * 1024 if $unit eq "g";
+    return $n;
+}
+
+
+# make_datafile(size)
+#    Returns the name of a text input file of `size` bytes, creating it
+#    if necessary.
+
+sub make_datafile ($) {
+    my ($size) = @_;
+    my ($fn) = "files/bench$size.txt";
+    if (!-r $fn || -s $fn != $size) {
+        truncate($fn, 0) if -e $fn;
+        while (!defined(-s $fn) || -s $fn < $size) {
+            system("cat /usr/share/dict/words >> $fn") == 0
+                or die "*** cannot create $fn\n";
+        }
+        truncate($fn, $size);
+    }
+    return $fn;
+}
+
+
+# decache(filename)
+#    Drops `filename` from the page cache.
+
+my ($decache_warned) = 0;
+
+sub decache ($) {
+    my ($fn) = @_;
+    if (defined(&{"SYS_fadvise64"}) && open(DECACHE, "<", $fn)) {
+        syscall &SYS_fadvise64, fileno(DECACHE), 0, -s DECACHE, 4;
+        close(DECACHE);
+    } elsif (!$decache_warned) {
+        print STDERR "*** warning: cannot drop page cache; cold runs are warm\n";
+        $decache_warned = 1;
+    }
+}
+
+
+# program_options(program)
+#    Returns the option string `program` passes to `io61_args`.
+
+my (%program_options);
+
+sub program_options ($) {
+    my ($prog) = @_;
+    if (!exists($program_options{$prog})) {
+        my ($opts) = "";
+        if (open(my $fh, "<", "$prog.cc")) {
+            local $/;
+            my $src = <$fh>;
+            $opts = $1 if $src =~ /io61_args\(\"([^\"]*)\"/;
+            close($fh);
+        }
+        $program_options{$prog} = $opts;
+    }
+    return $program_options{$prog};
+}
+
+
+# binary_name(program, variant)
+#    Returns the executable for `program` built with `variant`, building
+#    it if necessary.
+
+sub binary_name ($$) {
+    my ($prog, $variant) = @_;
+    my ($bin) = $variant eq "io61" ? "./$prog" : "./$variant-$prog";
+    if (!$param{"NOMAKE"}) {
+        system("make -s " . substr($bin, 2) . " 1>&2") == 0
+            or die "*** cannot build $bin\n";
+    }
+    die "*** $bin: not found\n" if !-x $bin;
+    return $bin;
+}
+
+
+# socketpipe_name()
+#    Returns the socketpipe executable, building it if necessary.
+
+sub socketpipe_name () {
+    if (!$param{"NOMAKE"}) {
+        system("make -s socketpipe 1>&2") == 0
+            or die "*** cannot build socketpipe\n";
+    }
+    die "*** ./socketpipe: not found\n" if !-x "./socketpipe";
+    return "./socketpipe";
+}
+
+
+# run_trial(argv)
+#    Runs the command in `@$argv` and returns a hash of its timing and
+#    io61 statistics, as reported on file descriptor 100. When several
+#    processes report (a socketpipe pipeline), their io61 counters are
+#    summed and other values take the maximum.
+
+sub run_trial ($) {
+    my ($argv) = @_;
+    my ($json) = "files/bench-json.$$";
+    my ($before) = Time::HiRes::time();
+    my ($pid) = fork();
+    die "fork: $!\n" if !defined($pid);
+    if ($pid == 0) {
+        my ($fd) = POSIX::open($json, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        POSIX::dup2($fd, 100);
+        POSIX::close($fd);
+        $fd = POSIX::open("/dev/null", O_RDWR);
+        POSIX::dup2($fd, 0);
+        POSIX::dup2($fd, 1);
+        POSIX::close($fd);
+        { exec { $argv->[0] } @$argv };
+        exit(127);
+    }
+
+    my ($answer) = {};
+    while (waitpid($pid, WNOHANG) == 0) {
+        if (Time::HiRes::time() > $before + $param{"MAXTIME"}) {
+            kill 9, $pid;
+            waitpid($pid, 0);
+            $answer->{"killed"} = 1;
+            last;
+        }
+        Time::HiRes::usleep(2000);
+    }
+    $answer->{"status"} = $?;
+    $answer->{"wall"} = Time::HiRes::time() - $before;
+
+    if (open(my $fh, "<", $json)) {
+        local $/;
+        my $buf = <$fh>;
+        close($fh);
+        my (%seen);
+        while (defined($buf) && $buf =~ m,\"(.*?)\"\s*:\s*([\d.]+),g) {
+            my ($k, $v) = ($1, $2);
+            if (!$seen{$k}++) {
+                $answer->{$k} = $v;
+            } elsif ($k =~ /\Aio61_/) {
+                $answer->{$k} += $v;
+            } elsif ($v > $answer->{$k}) {
+                $answer->{$k} = $v;
+            }
+        }
+    }
+    unlink($json);
+    $answer->{"time"} = $answer->{"wall"} if !defined($answer->{"time"});
+    return $answer;
+}
+
+
+# strace_syscalls(argv)
+#    Runs the command in `@$argv` under `strace -c` and returns its total
+#    number of file I/O system calls. Other calls, such as the `mmap`s
+#    and `openat`s of process startup, are not counted, so every variant
+#    is measured the same way.
+
+my ($strace_calls) = "read,write,lseek,pread64,pwrite64,readv,writev,"
+    . "preadv,pwritev,preadv2,pwritev2";
+
+sub strace_syscalls ($) {
+    my ($argv) = @_;
+    my ($out) = "files/bench-strace.$$";
+    system($STRACE, "-f", "-c", "-e", "trace=$strace_calls", "-o", $out, @$argv);
+    my ($n);
+    if (open(my $fh, "<", $out)) {
+        while (defined(my $line = <$fh>)) {
+            $n = $1 if $line =~ /\A\s*[\d.]+\s+[\d.]+\s+\d*\s+(\d+)\s+(?:\d+\s+)?total\s*\z/;
+        }
+        close($fh);
+    }
+    unlink($out);
+    return $n;
+}
+
+
+# statistics
+
+sub median (@) {
+    my (@x) = sort { $a <=> $b } @_;
+    return @x % 2 ? $x[$#x / 2] : ($x[@x / 2 - 1] + $x[@x / 2]) / 2;
+}
+
+# 97.5th percentiles of Student's t distribution, by degrees of freedom
+my (@t975) = (0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306,
+              2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110,
+              2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056,
+              2.052, 2.048, 2.045, 2.042);
+
+sub ci95 (@) {
+    my ($n) = scalar(@_);
+    return 0 if $n < 2;
+    my ($mean) = sum(@_) / $n;
+    my ($var) = sum(map { ($_ - $mean) ** 2 } @_) / ($n - 1);
+    my ($t) = $n - 1 < @t975 ? $t975[$n - 1] : 1.96;
+    return $t * sqrt($var / $n);
+}
+
+
+# output
+
+my (@columns) = ("commit", "program", "variant", "size", "block_size",
+                 "stride", "cache", "transport", "sockbuf", "trials",
+                 "errors", "median_s", "mean_s",
+                 "ci95_s", "min_s", "max_s", "mb_per_s", "syscalls",
+                 "syscalls_per_mb", "syscalls_source");
+my ($nrows) = 0;
+
+if ($param{"OUT"} ne "-") {
+    open(STDOUT, ">", $param{"OUT"}) or die "$param{OUT}: $!\n";
+}
+$| = 1;
+
+sub print_row ($) {
+    my ($row) = @_;
+    if ($param{"FORMAT"} eq "csv") {
+        print join(",", @columns), "\n" if $nrows == 0;
+        print join(",", map { defined($row->{$_}) ? $row->{$_} : "" } @columns), "\n";
+    } else {
+        print $nrows == 0 ? "[\n" : ",\n";
+        print "{", join(", ", map {
+            my $v = $row->{$_};
+            "\"$_\":" . (!defined($v) || $v eq "" ? "null"
+                         : $v =~ /\A-?\d+(?:\.\d+)?\z/ ? $v : "\"$v\"")
+        } @columns), "}";
+    }
+    ++$nrows;
+}
+
+
+# run_config(program, variant, size, blocksize, stride, cache, sockbuf)
+#    Runs one configuration for TRIALS trials and prints its row.
+#    `sockbuf` is "" for file output.
+
+sub run_config ($$$$$$$) {
+    my ($prog, $variant, $size, $bs, $stride, $cache, $sockbuf) = @_;
+    my ($infile) = make_datafile(parse_size($size));
+    my (@argv) = (binary_name($prog, $variant));
+    push @argv, "-b", $bs if $bs ne "";
+    push @argv, "-t", $stride if $stride ne "";
+    if ($sockbuf eq "") {
+        push @argv, "-o", "files/bench-out.$$", $infile;
+    } else {
+        push @argv, $infile, "|", binary_name("blockcat61", $variant);
+        push @argv, "-b", $bs if $bs ne "";
+        push @argv, "-o", "files/bench-out.$$";
+        unshift @argv, "-B", $sockbuf if $sockbuf;
+        unshift @argv, socketpipe_name();
+    }
+
+    # socketpipe doesn't wait for the first process, so check that the
+    # whole input arrived.
+    my ($bytes) = parse_size($size);
+    my (@times, @syscalls);
+    my ($errors) = 0;
+    for (my $i = 0; $i < $param{"TRIALS"}; ++$i) {
+        decache($infile) if $cache eq "cold";
+        my ($t) = run_trial(\@argv);
+        if ($t->{"killed"} || $t->{"status"} != 0
+            || ($sockbuf ne "" && (-s "files/bench-out.$$" // 0) != $bytes)) {
+            ++$errors;
+            next;
+        }
+        push @times, $t->{"time"};
+        if (!$STRACE) {
+            my ($nsys) = sum(map { $t->{"io61_$_"} || 0 } ("reads", "writes", "seeks"));
+            push @syscalls, $nsys if $nsys;
+        }
+    }
+    my ($source) = @syscalls ? "io61" : "";
+    if ($STRACE && $errors < $param{"TRIALS"}) {
+        decache($infile) if $cache eq "cold";
+        my ($n) = strace_syscalls(\@argv);
+        push @syscalls, $n if defined($n);
+        $source = "strace" if defined($n);
+    }
+    unlink("files/bench-out.$$");
+
+    my ($row) = {
+        "commit" => $COMMIT, "program" => $prog, "variant" => $variant,
+        "size" => $bytes, "block_size" => $bs, "stride" => $stride,
+        "cache" => $cache, "transport" => ($sockbuf eq "" ? "file" : "socket"),
+        "sockbuf" => $sockbuf, "trials" => scalar(@times), "errors" => $errors
+    };
+    if (@times) {
+        my ($med) = median(@times);
+        $row->{"median_s"} = sprintf("%.6f", $med);
+        $row->{"mean_s"} = sprintf("%.6f", sum(@times) / @times);
+        $row->{"ci95_s"} = sprintf("%.6f", ci95(@times));
+        $row->{"min_s"} = sprintf("%.6f", (sort { $a <=> $b } @times)[0]);
+        $row->{"max_s"} = sprintf("%.6f", (sort { $b <=> $a } @times)[0]);
+        $row->{"mb_per_s"} = sprintf("%.2f", $med > 0 ? $bytes / $med / 1048576 : 0);
+    }
+    if (@syscalls) {
+        my ($nsys) = median(@syscalls);
+        $row->{"syscalls"} = $nsys;
+        $row->{"syscalls_per_mb"} = sprintf("%.2f", $nsys * 1048576 / $bytes);
+        $row->{"syscalls_source"} = $source;
+    }
+    print_row($row);
+}
+
+
+die "*** Cannot create \`files\` directory.\n"
+    if !-d "files" && (-e "files" || !mkdir("files"));
+
+my (@sockbufs);
+foreach my $transport (split_param("TRANSPORT")) {
+    push @sockbufs, $transport eq "file" ? "" : split_param("SOCKBUFS");
+}
+
+foreach my $prog (split_param("PROGRAMS")) {
+    my ($opts) = program_options($prog);
+    die "*** $prog: unknown program\n" if $opts eq "";
+    my (@bss) = $opts =~ /b:/ ? split_param("BLOCKSIZES") : ("");
+    my (@strides) = $opts =~ /t:/ ? split_param("STRIDES") : ("");
+    foreach my $size (split_param("SIZES")) {
+        foreach my $bs (@bss) {
+            foreach my $stride (@strides) {
+                foreach my $cache (split_param("CACHE")) {
+                    foreach my $sockbuf (@sockbufs) {
+                        foreach my $variant (split_param("VARIANTS")) {
+                            run_config($prog, $variant, $size, $bs, $stride,
+                                       $cache, $sockbuf);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+print "\n]\n" if $param{"FORMAT"} eq "json" && $nrows > 0;
+exit(0);
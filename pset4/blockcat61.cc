@@ -1,12 +1,19 @@
 #include "io61.hh"
 
-// Usage: ./blockcat61 [-b BLOCKSIZE] [-o OUTFILE] [FILE]
+// Usage: ./blockcat61 [-b BLOCKSIZE] [-c CACHESIZE] [-m BYTES] [-C] [-d]
+//                     [-z] [-Z] [-K CRCFILE] [-o OUTFILE] [FILE]
 //    Copies the input FILE to standard output in blocks.
-//    Default BLOCKSIZE is 4096.
+//    Default BLOCKSIZE is 4096. `-c` sets the io61 cache block size, and
+//    `-m` limits the memory used by io61 cache buffers.
+//    `-C` corks socket output; with `-F`, every flush pushes it out.
+//    `-d` bypasses the page cache. `-z` decompresses the input and `-Z`
+//    compresses the output. `-K` checksums the data as io61 reads and
+//    writes it, checks that the checksums agree, and writes the CRC32C
+//    to CRCFILE.
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("b:o:i:D:Fy", 4096).parse(argc, argv);
+    io61_args args = io61_args("b:c:m:o:i:D:FyCdzZK:", 4096).parse(argc, argv);
 
     // Allocate buffer, open files
     unsigned char* buf = new unsigned char[args.block_size];
@@ -16,12 +23,25 @@ int main(int argc, char* argv[]) {
     args.after_open(inf, O_RDONLY);
     args.after_open(outf, O_WRONLY);
 
+    // Attach checksum transforms
+    io61_checksum incheck, outcheck;
+    uint32_t crc = 0;
+    if (args.checksum_file
+        && (io61_add_transform(inf, io61_checksum_transform, &incheck) == -1
+            || io61_add_transform(outf, io61_checksum_transform, &outcheck) == -1)) {
+        fprintf(stderr, "%s: checksum: %s\n", args.program_name, strerror(errno));
+        exit(1);
+    }
+
     // Copy file data
     while (true) {
         ssize_t nr = io61_read(inf, buf, args.block_size);
         if (nr <= 0) {
             break;
         }
+        if (args.checksum_file) {
+            crc = io61_crc32c(crc, buf, nr);
+        }
 
         ssize_t nw = io61_write(outf, buf, nr);
         assert(nw == nr);
@@ -32,4 +52,16 @@ int main(int argc, char* argv[]) {
     io61_close(inf);
     io61_close(outf);
     delete[] buf;
+
+    // Check and report checksums
+    if (args.checksum_file) {
+        assert(incheck.complete && outcheck.complete);
+        assert(incheck.crc32c == crc && outcheck.crc32c == crc);
+        assert(incheck.end == outcheck.end);
+        FILE* crcf = stdio_open_check(args.checksum_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+        fprintf(crcf, "%08x  %s\n", crc,
+                args.input_file ? args.input_file : "-");
+        fclose(crcf);
+    }
 }
@@ -1142,6 +1142,82 @@ enqueue("C22",
     "unmappable file, byte I/O, reverse order",
     "perf" => 0, "no_content_check" => 1, "insize" => 4096);
 
+enqueue("C23",
+    "./blockcat61 -d -b 1021 -o files/out.bin $binsm",
+    "1021B block I/O, page cache bypass, sequential correctness",
+    "perf" => 0, "expect" => $binsm);
+
+enqueue("C24",
+    "./blockcat61 -d -F -b 5000 -o files/out.txt $textsm",
+    "5000B block I/O, page cache bypass, flushed, sequential correctness",
+    "perf" => 0, "expect" => $textsm);
+
+enqueue("C25",
+    "./carefulcat61 -a 0.001 $textsm | ./pollcat61 -b 117 -B 4096 | ./syscall-carefulblockcat61 -D 0.002 -b 117 -y > files/out.txt",
+    "117B block I/O, nonblocking poll loop, short-piped, sequential correctness",
+    "perf" => 0, "expect" => $textsm);
+
+enqueue("C26",
+    "cat $textsm | ./carefulblockcat61 -n -F -b 1000 -B 4096 | ./syscall-carefulblockcat61 -D 0.002 -b 4096 > files/out.txt",
+    "1000B block I/O, nonblocking, flushed, short-piped, sequential correctness",
+    "perf" => 0, "expect" => $textsm);
+
+enqueue("C27",
+    "./scattergather61 -b 128 -l -m 16384 -o files/out1.txt -o files/out2.txt -o files/out3.txt -o files/out4.txt -i $textsm -i $revtextsm -i $textsm",
+    "scatter/gather 4/3 files by lines, 16KiB buffer memory budget",
+    "perf" => 0);
+
+enqueue("C28",
+    "cat $textsm | ./vectorcat61 -b 1021 | cat > files/out.txt",
+    "1021B 3-piece vector I/O, piped, sequential correctness",
+    "perf" => 0, "expect" => $textsm);
+
+enqueue("C29",
+    "cat $textsm | ./blockcat61 -Z -F -b 4096 | ./blockcat61 -z -b 1000 > files/out.txt",
+    "4096B block I/O, compressed stream roundtrip, flushed, piped",
+    "perf" => 0, "expect" => $textsm);
+
+enqueue("C30",
+    "./blockcat61 -Z -b 4096 -o files/out.z $textsm && ./reverse61 -z -o files/out.rev files/out.z && ./reverse61 -o files/out.txt files/out.rev",
+    "compressed stream, frame-indexed reverse reads",
+    "perf" => 0, "expect" => $textsm);
+
+enqueue("C31",
+    "./blockcat61 -K files/crc1.txt -b 1000 -o files/out.txt $textsm",
+    "1000B block I/O, streaming checksum transforms, sequential correctness",
+    "perf" => 0, "expect" => $textsm);
+
+enqueue("C32",
+    "cat $textsm | ./blockcat61 -Z -F -K files/crc1.txt -b 4096 | ./blockcat61 -z -K files/crc2.txt -b 777 > files/out.txt",
+    "streaming checksums of compressed stream roundtrip, piped",
+    "perf" => 0, "expect" => $textsm);
+
+enqueue("C33",
+    "cat $textsm | ./blockcat61 -c 4194304 -b 65536 | ./blockcat61 -c 3000000 -b 4096 -o files/out.txt",
+    "huge-page-sized io61 caches, piped, sequential correctness",
+    "perf" => 0, "expect" => $textsm);
+
+enqueue("C34",
+    "./socketpipe -B 65536 ./blockcat61 -C -F -b 1000 $textsm '|' ./blockcat61 -b 777 -o files/out.txt",
+    "1000B block I/O, corked TCP socket with timeouts, flushed",
+    "perf" => 0, "expect" => $textsm);
+
+enqueue("C35",
+    "cat $texttiny | ./reverse61 -q -b 1024 -s 32768 -o files/out.rev && ./cat61 -o files/out.txt $texttiny",
+    "piped input, block I/O, reverse reads fail cleanly",
+    "perf" => 0, "expect" => $texttiny);
+
+enqueue("C36",
+    "./blockcat61 -d -m 4096 -b 1000 -o files/out.txt $textsm",
+    "1000B block I/O, page cache bypass, 4KiB buffer memory budget",
+    "perf" => 0, "expect" => $textsm);
+
+enqueue("C37",
+    "./scattergather61 -b 65536 -l -m 8192 -o files/out1.txt -o files/out2.txt -i $binsm -i $textsm -i $binsm",
+    "scatter/gather 3/2 files by long lines, zero-copy line views, 8KiB buffer memory budget",
+    "perf" => 0);
+
+
 
 # REGULAR FILES, SEQUENTIAL I/O
 enqueue("MSEQ1",
@@ -1173,6 +1249,10 @@ enqueue("MSEQ7",
     "./blockcat61 -b 1024 $textmd | cat > files/out.txt",
     "mixed-piped medium file, 1KB block I/O, sequential");
 
+enqueue("MSEQ8",
+    "./scattergather61 -b 4096 -l -o files/out.txt $textmd",
+    "regular medium file, line I/O, sequential");
+
 
 
 # NONSEQUENTIAL
@@ -1233,6 +1313,15 @@ enqueue("LSEQ9",
     "./randblockcat61 $textlg > files/out.txt",
     "redirected large file, 1B-4KB block I/O, sequential");
 
+enqueue("LSEQ10",
+    "./blockcat61 -d -b 65536 -o files/out.txt $textlg",
+    "regular large file, 64KB block I/O, page cache bypass, sequential correctness",
+    "perf" => 0, "expect" => $textlg);
+
+enqueue("LSEQ11",
+    "./vectorcat61 -b 1048576 -o files/out.txt $textlg",
+    "regular large file, 1MB 3-piece vector I/O, sequential");
+
 enqueue("LNONSEQ1",
     "./reverse61 -s 8388608 -o files/out.txt $textlg",
     "regular large file, byte I/O, reverse order");
@@ -1245,6 +1334,10 @@ enqueue("LNONSEQ3",
     "./reordercat61 -r 6582 -o files/out.txt $textlg",
     "regular large file, 4KB block I/O, random seek order");
 
+enqueue("LNONSEQ4",
+    "./reverse61 -b 4096 -o files/out.txt $textlg",
+    "regular large file, 4KB block I/O, reverse order");
+
 
 run($param{"SEQTEST"});
 
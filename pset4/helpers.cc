@@ -1,8 +1,13 @@
 #include "io61.hh"
+#include <ctime>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <poll.h>
 #include <csignal>
 #include <cerrno>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 // helpers.cc
 //    The io61_args() structure parses command line arguments.
@@ -45,6 +50,101 @@ FILE* stdio_open_check(const char* filename, int mode) {
 }
 
 
+// io61_crc32c(crc, data, sz)
+//    Returns the CRC32C (Castagnoli) checksum of `data[0, sz)`, continuing
+//    from `crc`, the checksum of the data before it (0 to start). Uses the
+//    SSE4.2 `crc32` instruction when the CPU has it, and otherwise (or if
+//    the environment sets `IO61_CRC32C_SOFTWARE`) a slicing-by-8 table.
+
+namespace {
+
+struct crc32c_table {
+    uint32_t t[8][256];
+
+    crc32c_table() {
+        for (uint32_t i = 0; i != 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k != 8; ++k) {
+                c = (c >> 1) ^ (c & 1 ? 0x82F63B78U : 0);
+            }
+            t[0][i] = c;
+        }
+        for (int k = 1; k != 8; ++k) {
+            for (int i = 0; i != 256; ++i) {
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+uint32_t crc32c_software(uint32_t c, const unsigned char* p, size_t sz) {
+    static const crc32c_table table;
+    auto& t = table.t;
+    for (; sz >= 8; p += 8, sz -= 8) {
+        uint32_t lo = c ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24);
+        uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t) p[7] << 24;
+        c = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF]
+            ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24]
+            ^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF]
+            ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    }
+    for (; sz != 0; ++p, --sz) {
+        c = t[0][(c ^ *p) & 0xFF] ^ (c >> 8);
+    }
+    return c;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hardware(uint32_t c, const unsigned char* p, size_t sz) {
+    for (; sz != 0 && (uintptr_t) p % 8 != 0; ++p, --sz) {
+        c = _mm_crc32_u8(c, *p);
+    }
+    uint64_t c64 = c;
+    for (; sz >= 8; p += 8, sz -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c64 = _mm_crc32_u64(c64, w);
+    }
+    c = c64;
+    for (; sz != 0; ++p, --sz) {
+        c = _mm_crc32_u8(c, *p);
+    }
+    return c;
+}
+#endif
+
+}
+
+uint32_t io61_crc32c(uint32_t crc, const unsigned char* data, size_t sz) {
+#if defined(__x86_64__)
+    static const bool hardware = __builtin_cpu_supports("sse4.2")
+        && !getenv("IO61_CRC32C_SOFTWARE");
+    if (hardware) {
+        return ~crc32c_hardware(~crc, data, sz);
+    }
+#endif
+    return ~crc32c_software(~crc, data, sz);
+}
+
+
+// io61_checksum_transform(arg, off, data, sz)
+//    An `io61_add_transform` stage that adds `data` to the CRC32C in
+//    `*(io61_checksum*) arg`.
+
+void io61_checksum_transform(void* arg, off_t off,
+                             const unsigned char* data, size_t sz) {
+    io61_checksum* ck = (io61_checksum*) arg;
+    if (ck->start < 0) {
+        ck->start = ck->end = off;
+    } else if (off != ck->end) {
+        ck->complete = false;
+    }
+    ck->crc32c = io61_crc32c(ck->crc32c, data, sz);
+    ck->end = off + sz;
+}
+
+
 // monotonic_timestamp()
 //    Returns the current monotonic timestamp.
 
@@ -120,6 +220,15 @@ io61_args& io61_args::parse(int argc, char** argv) {
         case 'q':
             this->quiet = true;
             break;
+        case 'd':
+            this->direct = true;
+            break;
+        case 'z':
+            this->zinput = true;
+            break;
+        case 'Z':
+            this->zoutput = true;
+            break;
         case 'i':
             this->input_files.push_back(optarg);
             break;
@@ -158,6 +267,25 @@ io61_args& io61_args::parse(int argc, char** argv) {
                 goto usage;
             }
             break;
+        case 'm':
+            this->memory_budget = (size_t) strtoul(optarg, &endptr, 0);
+            if (this->memory_budget == 0 || endptr == optarg || *endptr) {
+                goto usage;
+            }
+            io61_set_memory_budget(this->memory_budget);
+            break;
+        case 'c':
+            this->cache_size = (size_t) strtoul(optarg, &endptr, 0);
+            if (this->cache_size == 0 || endptr == optarg || *endptr) {
+                goto usage;
+            }
+            break;
+        case 'C':
+            this->cork = true;
+            break;
+        case 'K':
+            this->checksum_file = optarg;
+            break;
         case '#':
         default:
             goto usage;
@@ -243,6 +371,27 @@ void io61_args::usage() {
     if (strchr(this->opts, 'B')) {
         fprintf(stderr, "    -B BUFSIZ     Set input pipe buffer size on Linux\n");
     }
+    if (strchr(this->opts, 'd')) {
+        fprintf(stderr, "    -d            Bypass the page cache (O_DIRECT)\n");
+    }
+    if (strchr(this->opts, 'z')) {
+        fprintf(stderr, "    -z            Read compressed input\n");
+    }
+    if (strchr(this->opts, 'Z')) {
+        fprintf(stderr, "    -Z            Write compressed output\n");
+    }
+    if (strchr(this->opts, 'm')) {
+        fprintf(stderr, "    -m BYTES      Limit io61 cache buffer memory\n");
+    }
+    if (strchr(this->opts, 'c')) {
+        fprintf(stderr, "    -c BYTES      Set io61 cache block size\n");
+    }
+    if (strchr(this->opts, 'C')) {
+        fprintf(stderr, "    -C            Cork socket output between flushes\n");
+    }
+    if (strchr(this->opts, 'K')) {
+        fprintf(stderr, "    -K FILE       Write CRC32C of data copied to FILE\n");
+    }
     if (strchr(this->opts, 'r')) {
         fprintf(stderr, "    -r            Set random seed (default %u)\n", this->seed);
     }
@@ -282,6 +431,26 @@ void io61_args::after_open(int fd, int mode) {
 }
 
 void io61_args::after_open(io61_file* f, int mode) {
+    if (this->cache_size && io61_set_bufsize(f, this->cache_size) == -1) {
+        fprintf(stderr, "%s: cannot set cache size %zu\n",
+                this->program_name, this->cache_size);
+        exit(1);
+    }
+    if (this->direct) {
+        io61_set_direct(f, true);
+    }
+    if (mode != O_RDONLY && this->cork && io61_set_cork(f, true) == -1) {
+        fprintf(stderr, "%s: cork output: %s\n", this->program_name,
+                strerror(errno));
+        exit(1);
+    }
+    if (mode == O_RDONLY ? this->zinput : this->zoutput) {
+        if (io61_set_compressed(f) == -1) {
+            fprintf(stderr, "%s: compressed %s: %s\n", this->program_name,
+                    mode == O_RDONLY ? "input" : "output", strerror(errno));
+            exit(1);
+        }
+    }
     this->after_open(io61_fileno(f), mode);
 }
 
@@ -298,7 +467,11 @@ void io61_args::after_write(int fd) {
 
 void io61_args::after_write(io61_file* f) {
     if (this->flush) {
-        int r = io61_flush(f);
+        int r;
+        while ((r = io61_flush(f)) == -1 && errno == EAGAIN) {
+            pollfd pfd = { io61_fileno(f), POLLOUT, 0 };
+            poll(&pfd, 1, -1);
+        }
         assert(r == 0);
     }
     if (this->yield > 0) {
@@ -352,13 +525,25 @@ io61_profiler::~io61_profiler() {
     maxrss = (maxrss + 1023) / 1024;
 #endif
 
+    // Add io61 statistics for all closed files. Keys are flat so that
+    // check.pl's simple parser can read them.
+    io61_counters st = io61_stats(nullptr);
+
     char buf[1000];
     ssize_t len = snprintf(buf, sizeof(buf),
-        "{\"time\":%.6f, \"utime\":%ld.%06ld, \"stime\":%ld.%06ld, \"maxrss\":%ld}\n",
+        "{\"time\":%.6f, \"utime\":%ld.%06ld, \"stime\":%ld.%06ld, \"maxrss\":%ld, "
+        "\"io61_reads\":%llu, \"io61_writes\":%llu, \"io61_seeks\":%llu, "
+        "\"io61_bytes_requested\":%llu, \"io61_bytes_moved\":%llu, "
+        "\"io61_hits\":%llu, \"io61_misses\":%llu, \"io61_flushes\":%llu, "
+        "\"io61_syscall_time\":%.6f}\n",
         real_elapsed,
         usage.ru_utime.tv_sec, (long) usage.ru_utime.tv_usec,
         usage.ru_stime.tv_sec, (long) usage.ru_stime.tv_usec,
-        maxrss);
+        maxrss,
+        st.nreads, st.nwrites, st.nseeks,
+        st.bytes_requested, st.bytes_moved,
+        st.hits, st.misses, st.nflushes,
+        st.syscall_time);
 
     off_t off = lseek(100, 0, SEEK_CUR);
     int fd = (off != (off_t) -1 || errno == ESPIPE ? 100 : STDERR_FILENO);
@@ -9,13 +9,65 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sched.h>
+#include <sys/uio.h>
+#include <cstdint>
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+// `io61_open_check` mode flag for compressed streams
+#define IO61_COMPRESSED 0x40000000
 
 struct io61_file;
 
+
+// io61_counters
+//    Per-file I/O statistics, returned by `io61_stats`.
+
+struct io61_counters {
+    unsigned long long nreads = 0;           // `read` system calls
+    unsigned long long nwrites = 0;          // `write` system calls
+    unsigned long long nseeks = 0;           // `lseek` system calls
+    unsigned long long bytes_requested = 0;  // bytes passed to io61 calls
+    unsigned long long bytes_moved = 0;      // bytes moved by the kernel
+    unsigned long long hits = 0;             // calls served from the cache
+    unsigned long long misses = 0;           // calls that made system calls
+    unsigned long long nflushes = 0;         // flushes that wrote data
+    double syscall_time = 0;                 // seconds blocked in syscalls
+                                             // (if `IO61_SYSCALL_TIME` is set)
+};
+
+
+// io61_transform_function
+//    A streaming stage for `io61_add_transform`. Called with its `arg`,
+//    the file offset of `data`, and `sz` bytes of file data.
+
+typedef void (*io61_transform_function)(void* arg, off_t off,
+                                        const unsigned char* data, size_t sz);
+
+
+// io61_checksum
+//    State for the `io61_checksum_transform` stage, which computes the
+//    CRC32C of the data it sees.
+
+struct io61_checksum {
+    uint32_t crc32c = 0;     // CRC32C of the data seen
+    off_t start = -1;        // file offset of first byte seen
+    off_t end = -1;          // file offset after last byte seen
+    bool complete = true;    // false if data in [start, end) was skipped
+};
+
 io61_file* io61_fdopen(int fd, int mode);
 io61_file* io61_open_check(const char* filename, int mode);
 int io61_fileno(io61_file* f);
+bool io61_wants_read(io61_file* f);
+bool io61_wants_write(io61_file* f);
 int io61_close(io61_file* f);
+int io61_set_bufsize(io61_file* f, size_t sz);
+int io61_set_direct(io61_file* f, bool on);
+int io61_set_compressed(io61_file* f);
+int io61_add_transform(io61_file* f, io61_transform_function fn, void* arg);
+int io61_set_cork(io61_file* f, bool on);
+void io61_set_memory_budget(size_t sz);
 
 off_t io61_filesize(io61_file* f);
 
@@ -26,9 +78,22 @@ int io61_writec(io61_file* f, int ch);
 
 ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz);
 ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz);
+ssize_t io61_readv(io61_file* f, const iovec* iov, int iovcnt);
+ssize_t io61_writev(io61_file* f, const iovec* iov, int iovcnt);
+ssize_t io61_read_backward(io61_file* f, unsigned char* buf, size_t sz);
+
+ssize_t io61_getdelim(io61_file* f, unsigned char* buf, size_t sz, int delim);
+ssize_t io61_getdelim_view(io61_file* f, const unsigned char** linep,
+                           size_t sz, int delim);
 
 int io61_flush(io61_file* f);
 
+io61_counters io61_stats(io61_file* f);
+
+uint32_t io61_crc32c(uint32_t crc, const unsigned char* data, size_t sz);
+void io61_checksum_transform(void* arg, off_t off,
+                             const unsigned char* data, size_t sz);
+
 int fd_open_check(const char* filename, int mode);
 FILE* stdio_open_check(const char* filename, int mode);
 
@@ -41,6 +106,9 @@ struct io61_args {
     bool lines = false;                 // `-l`: read by lines
     bool flush = false;                 // `-F`: flush output
     bool quiet = false;                 // `-q`: ignore errors
+    bool direct = false;                // `-d`: bypass page cache
+    bool zinput = false;                // `-z`: input is compressed
+    bool zoutput = false;               // `-Z`: compress output
     unsigned yield = 0;                 // `-y`: yield after output
     const char* output_file = nullptr;  // `-o`: output file
     const char* input_file = nullptr;   // input file
@@ -53,6 +121,10 @@ struct io61_args {
     double delay = 0.0;                 // `-D`: delay
     size_t pipebuf_size = 0;            // `-B`: pipe buffer size
     bool nonblocking = false;           // `-n`: nonblocking
+    size_t memory_budget = 0;           // `-m`: io61 buffer memory budget
+    size_t cache_size = 0;              // `-c`: io61 cache block size
+    bool cork = false;                  // `-C`: cork socket output
+    const char* checksum_file = nullptr;  // `-K`: write checksum to file
 
     explicit io61_args(const char* opts, size_t block_size = 0);
 
@@ -73,4 +145,10 @@ struct io61_args {
     void after_write(FILE* f);
 };
 
+
+// convenience versions
+inline ssize_t io61_readline(io61_file* f, unsigned char* buf, size_t sz) {
+    return io61_getdelim(f, buf, sz, '\n');
+}
+
 #endif
@@ -0,0 +1,80 @@
+#include "io61.hh"
+#include <cerrno>
+#include <poll.h>
+
+// Usage: ./pollcat61 [-b BLOCKSIZE] [-o OUTFILE] [FILE]
+//    Copies the input FILE to OUTFILE in blocks. Both files are made
+//    nonblocking, and a single `poll` loop waits for whichever one
+//    io61 says it needs. Default BLOCKSIZE is 4096.
+
+static bool is_retry(ssize_t r) {
+    return r == -1 && (errno == EAGAIN || errno == EINTR);
+}
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_args args = io61_args("b:o:i:B:D:a:", 4096).parse(argc, argv);
+
+    // Allocate buffer, open files
+    unsigned char* buf = new unsigned char[args.block_size];
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+    args.nonblocking = true;
+    args.after_open(inf, O_RDONLY);
+    args.after_open(outf, O_WRONLY);
+
+    // Copy file data; `buf[pos, len)` is read but not yet written
+    size_t pos = 0, len = 0;
+    bool eof = false;
+    while (true) {
+        bool progress = false;
+        if (pos == len && !eof) {
+            ssize_t nr = io61_read(inf, buf, args.block_size);
+            if (nr > 0) {
+                pos = 0;
+                len = nr;
+                progress = true;
+            } else if (nr == 0) {
+                eof = progress = true;
+            } else {
+                assert(is_retry(nr));
+            }
+        }
+        if (pos < len) {
+            ssize_t nw = io61_write(outf, buf + pos, len - pos);
+            if (nw > 0) {
+                pos += nw;
+                progress = true;
+            } else {
+                assert(is_retry(nw));
+            }
+        }
+        if (eof && pos == len) {
+            int r = io61_flush(outf);
+            if (r == 0) {
+                break;
+            }
+            assert(is_retry(r));
+        }
+
+        // Wait for a file descriptor when neither file can make progress
+        if (!progress) {
+            pollfd pfds[2];
+            int npfds = 0;
+            if (pos == len && !eof && io61_wants_read(inf)) {
+                pfds[npfds++] = { io61_fileno(inf), POLLIN, 0 };
+            }
+            if (io61_wants_write(outf)) {
+                pfds[npfds++] = { io61_fileno(outf), POLLOUT, 0 };
+            }
+            if (npfds > 0) {
+                poll(pfds, npfds, -1);
+            }
+        }
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    delete[] buf;
+}
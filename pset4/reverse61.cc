@@ -1,17 +1,20 @@
 #include "io61.hh"
 
-// Usage: ./reverse61 [-s SIZE] [-o OUTFILE] [FILE]
+// Usage: ./reverse61 [-s SIZE] [-b BLOCKSIZE] [-z] [-o OUTFILE] [FILE]
 //    Copies the input FILE to OUTFILE one character at a time,
-//    reversing the order of characters in the input.
+//    reversing the order of characters in the input. With `-b`, reads
+//    BLOCKSIZE characters at a time with `io61_read_backward`. `-z`
+//    reads a compressed input FILE.
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("s:o:i:qFy").parse(argc, argv);
+    io61_args args = io61_args("s:b:o:i:qFyz").parse(argc, argv);
 
     // Open files, measure file sizes
     io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
     io61_file* outf = io61_open_check(args.output_file,
                                       O_WRONLY | O_CREAT | O_TRUNC);
+    args.after_open(inf, O_RDONLY);
 
     if ((ssize_t) args.file_size < 0) {
         args.file_size = io61_filesize(inf);
@@ -25,6 +28,30 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
 
+    // Copy blocks, if requested
+    if (args.block_size != 0) {
+        unsigned char* buf = new unsigned char[args.block_size];
+        int r = io61_seek(inf, args.file_size);
+        assert(r == 0 || args.quiet);
+        while (args.file_size != 0) {
+            size_t sz = std::min(args.block_size, args.file_size);
+            ssize_t nr = io61_read_backward(inf, buf, sz);
+            if (nr <= 0) {
+                // the input cannot be read backward (for instance, a pipe)
+                assert(args.quiet);
+                args.file_size = 0;
+                break;
+            }
+
+            ssize_t nw = io61_write(outf, buf, nr);
+            assert(nw == nr);
+
+            args.file_size -= nr;
+            args.after_write(outf);
+        }
+        delete[] buf;
+    }
+
     while (args.file_size != 0) {
         --args.file_size;
         int r = io61_seek(inf, args.file_size);
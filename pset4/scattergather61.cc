@@ -1,39 +1,46 @@
 #include "io61.hh"
 #include <vector>
 
-// Usage: ./scattergather61 [-b BLOCKSIZE] [-i IFILE | -o OFILE]...
+// Usage: ./scattergather61 [-b BLOCKSIZE] [-m BYTES] [-i IFILE | -o OFILE]...
 //    Copies the input IFILEs to the output OFILEs, alternating
 //    with every block. (I.e., read from IFILE1 and write to OFILE1,
 //    then read from IFILE2 and write to OFILE2, etc. There may be
 //    different numbers of IFILEs and OFILEs.) This is a
 //    "scatter/gather" I/O pattern: input is "gathered" from many
 //    input files and "scattered" to many output files.
-//    Default BLOCKSIZE is 1.
+//    Default BLOCKSIZE is 1. With `-l`, each block is a line of at most
+//    BLOCKSIZE bytes, copied straight out of io61's cache with
+//    `io61_getdelim_view`. `-m BYTES` limits the memory io61 uses for
+//    cache buffers across all files.
 
-ssize_t read_line(io61_file* f, unsigned char* buf, size_t sz, bool lines) {
-    if (lines) {
-        size_t i = 0;
-        while (i != sz) {
-            int ch = io61_readc(f);
-            if (ch == EOF) {
-                break;
-            }
-            buf[i] = ch;
-            ++i;
-            if (ch == '\n') {
-                break;
-            }
+// copy_line(inf, outf, sz)
+//    Copies one line of at most `sz` bytes from `inf` to `outf`. Returns
+//    the number of bytes copied, 0 at end of file, or -1 on error.
+
+ssize_t copy_line(io61_file* inf, io61_file* outf, size_t sz) {
+    size_t ncopied = 0;
+    while (ncopied != sz) {
+        const unsigned char* line;
+        ssize_t nr = io61_getdelim_view(inf, &line, sz - ncopied, '\n');
+        if (nr <= 0) {
+            return ncopied != 0 ? ncopied : nr;
+        }
+        // `line` may not survive the write, so check for the end first
+        bool eol = line[nr - 1] == '\n';
+        ssize_t nw = io61_write(outf, line, nr);
+        assert(nw == nr);
+        ncopied += nr;
+        if (eol) {
+            break;
         }
-        return i;
-    } else {
-        return io61_read(f, buf, sz);
     }
+    return ncopied;
 }
 
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("b:i:o:l##", 1).parse(argc, argv);
+    io61_args args = io61_args("b:i:o:lm:##", 1).parse(argc, argv);
 
     // Allocate buffer, open files
     unsigned char* buf = new unsigned char[args.block_size];
@@ -52,14 +59,21 @@ int main(int argc, char* argv[]) {
     size_t ini = -1, outi = 0;
     while (!infs.empty()) {
         ini = (ini + 1) % infs.size();
-        ssize_t nr = read_line(infs[ini], buf, args.block_size, args.lines);
+        ssize_t nr;
+        if (args.lines) {
+            nr = copy_line(infs[ini], outfs[outi], args.block_size);
+        } else {
+            nr = io61_read(infs[ini], buf, args.block_size);
+            if (nr > 0) {
+                ssize_t nw = io61_write(outfs[outi], buf, nr);
+                assert(nw == nr);
+            }
+        }
         if (nr <= 0) {
             io61_close(infs[ini]);
             infs.erase(infs.begin() + ini);
             --ini;
         } else {
-            ssize_t nw = io61_write(outfs[outi], buf, nr);
-            assert(nw == nr);
             outi = (outi + 1) % outfs.size();
         }
     }
@@ -1,21 +1,23 @@
 #include "io61.hh"
 
 // Usage: ./stridecat61 [-b BLOCKSIZE] [-t STRIDE] [-s SIZE]
-//                      [-p POSITION] [-o OUTFILE] [FILE]
+//                      [-p POSITION] [-z] [-o OUTFILE] [FILE]
 //    Copies the input FILE to OUTFILE in blocks, shuffling its
 //    contents. Reads FILE in a strided access pattern, but writes
 //    sequentially. Default BLOCKSIZE is 1 and default STRIDE is
 //    1024. This means the input file's bytes are read in the sequence
-//    0, 1024, 2048, ..., 1, 1025, 2049, ..., etc.
+//    0, 1024, 2048, ..., 1, 1025, 2049, ..., etc. `-z` reads a
+//    compressed input FILE.
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("b:t:s:o:p:", 1).parse(argc, argv);
+    io61_args args = io61_args("b:t:s:o:p:z", 1).parse(argc, argv);
 
     // Allocate buffer, open files, measure file sizes
     unsigned char* buf = new unsigned char[args.block_size];
 
     io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    args.after_open(inf, O_RDONLY);
 
     if ((ssize_t) args.file_size < 0) {
         args.file_size = io61_filesize(inf);
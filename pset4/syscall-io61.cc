@@ -3,6 +3,7 @@
 #include <sys/stat.h>
 #include <climits>
 #include <cerrno>
+#include <algorithm>
 
 // syscall-io61.cc
 //    This version of io61.cc makes one system call per read/write.
@@ -13,6 +14,7 @@
 
 struct io61_file {
     int fd = -1;     // file descriptor
+    unsigned char view[4096];  // `io61_getdelim_view`'s copy of a line
 };
 
 
@@ -41,6 +43,82 @@ int io61_close(io61_file* f) {
 }
 
 
+// io61_set_bufsize(f, sz)
+//    Sets the cache block size of `f` to `sz` bytes. Returns 0 on success
+//    and -1 on failure.
+//
+//    This version has no cache, so it does nothing.
+
+int io61_set_bufsize(io61_file* f, size_t sz) {
+    (void) f, (void) sz;
+    return 0;
+}
+
+
+// io61_set_direct(f, on)
+//    Turns page-cache-bypassing mode on or off for `f`. Returns 0 on
+//    success and -1 on failure.
+//
+//    This version does not support it.
+
+int io61_set_direct(io61_file* f, bool on) {
+    (void) f;
+    return on ? -1 : 0;
+}
+
+
+// io61_set_compressed(f)
+//    Puts `f` in compressed stream mode. Returns 0 on success and -1 on
+//    failure.
+//
+//    This version does not support it.
+
+int io61_set_compressed(io61_file* f) {
+    (void) f;
+    errno = ENOTSUP;
+    return -1;
+}
+
+
+// io61_add_transform(f, fn, arg)
+//    Attaches a streaming transform to `f`. Returns 0 on success and -1
+//    on failure.
+//
+//    This version does not support it.
+
+int io61_add_transform(io61_file* f, io61_transform_function fn, void* arg) {
+    (void) f, (void) fn, (void) arg;
+    errno = ENOTSUP;
+    return -1;
+}
+
+
+// io61_set_cork(f, on)
+//    Turns corking on or off for `f`, a TCP socket opened for writing.
+//    Returns 0 on success and -1 on failure.
+//
+//    This version does not support it.
+
+int io61_set_cork(io61_file* f, bool on) {
+    (void) f;
+    if (on) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return 0;
+}
+
+
+// io61_set_memory_budget(sz)
+//    Limits the memory io61 uses for cache buffers to about `sz` bytes.
+//
+//    This version does not manage buffer memory, so it does nothing.
+
+void io61_set_memory_budget(size_t sz) {
+    (void) sz;
+}
+
+
 // io61_readc(f)
 //    Reads a single (unsigned) byte from `f` and returns it. Returns EOF,
 //    which equals -1, on end of file or error.
@@ -75,6 +153,49 @@ ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
 }
 
 
+// io61_getdelim(f, buf, sz, delim)
+//    Reads bytes from `f` into `buf` up to and including the first `delim`
+//    character. Stops early after `sz` bytes or at end of file. Returns the
+//    number of bytes read, 0 at end of file, or -1 if an error is
+//    encountered before any bytes are read.
+
+ssize_t io61_getdelim(io61_file* f, unsigned char* buf, size_t sz, int delim) {
+    size_t nread = 0;
+    while (nread != sz) {
+        int ch = io61_readc(f);
+        if (ch == EOF) {
+            break;
+        }
+        buf[nread] = ch;
+        ++nread;
+        if (ch == delim) {
+            break;
+        }
+    }
+    if (nread != 0 || sz == 0 || errno == 0) {
+        return nread;
+    } else {
+        return -1;
+    }
+}
+
+
+// io61_getdelim_view(f, linep, sz, delim)
+//    Like `io61_getdelim`, but sets `*linep` to point at the bytes read
+//    instead of copying them to a caller's buffer. `*linep` is valid
+//    until the next operation on `f`.
+//
+//    This version has no cache to point into, so it copies the line into
+//    a buffer inside `f`, and returns at most that buffer's size; call
+//    again for the rest of a longer line.
+
+ssize_t io61_getdelim_view(io61_file* f, const unsigned char** linep,
+                           size_t sz, int delim) {
+    *linep = f->view;
+    return io61_getdelim(f, f->view, std::min(sz, sizeof(f->view)), delim);
+}
+
+
 // io61_writec(f)
 //    Write a single character `ch` to `f`. Returns 0 on success and
 //    -1 on error.
@@ -103,6 +224,50 @@ ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
 }
 
 
+// io61_readv(f, iov, iovcnt)
+//    Reads data from `f` into the `iovcnt` buffers described by `iov`,
+//    filling each in turn. Returns the total number of bytes read, 0 at
+//    end of file, or -1 if an error is encountered before any bytes are
+//    read.
+
+ssize_t io61_readv(io61_file* f, const iovec* iov, int iovcnt) {
+    return readv(f->fd, iov, iovcnt);
+}
+
+
+// io61_writev(f, iov, iovcnt)
+//    Writes the `iovcnt` buffers described by `iov` to `f`, in order.
+//    Returns the total number of bytes written, or -1 if an error is
+//    encountered before any bytes are written.
+
+ssize_t io61_writev(io61_file* f, const iovec* iov, int iovcnt) {
+    return writev(f->fd, iov, iovcnt);
+}
+
+
+// io61_read_backward(f, buf, sz)
+//    Reads up to `sz` bytes that precede `f`'s file position into `buf`,
+//    last byte first, and moves the file position back to the earliest
+//    byte read. Returns the number of bytes read, 0 at the start of the
+//    file, or -1 if an error is encountered before any bytes are read.
+//
+//    This version reads the bytes forward with `pread`, then reverses them.
+
+ssize_t io61_read_backward(io61_file* f, unsigned char* buf, size_t sz) {
+    off_t pos = lseek(f->fd, 0, SEEK_CUR);
+    if (pos == -1) {
+        return -1;
+    }
+    size_t n = std::min(sz, (size_t) pos);
+    if (pread(f->fd, buf, n, pos - n) != (ssize_t) n
+        || lseek(f->fd, pos - n, SEEK_SET) == -1) {
+        return -1;
+    }
+    std::reverse(buf, buf + n);
+    return n;
+}
+
+
 // io61_flush(f)
 //    Forces a write of any cached data written to `f`. Returns 0 on
 //    success. Returns -1 if an error is encountered before all cached
@@ -131,6 +296,18 @@ int io61_seek(io61_file* f, off_t pos) {
 }
 
 
+// io61_stats(f)
+//    Returns the I/O statistics collected for `f`, or for all closed
+//    files if `f == nullptr`.
+//
+//    This version does not collect statistics.
+
+io61_counters io61_stats(io61_file* f) {
+    (void) f;
+    return io61_counters();
+}
+
+
 // You shouldn't need to change these functions.
 
 // io61_open_check(filename, mode)
@@ -164,6 +341,25 @@ int io61_fileno(io61_file* f) {
 }
 
 
+// io61_wants_read(f), io61_wants_write(f)
+//    Readiness hints for event loops: after an io61 call on `f` fails
+//    with EAGAIN, wait for `io61_fileno(f)` to become readable if
+//    `io61_wants_read(f)`, or writable if `io61_wants_write(f)`.
+//
+//    This version has no cache, so a read file always needs data and a
+//    write file always needs room: no written data is ever held back, so
+//    a write that failed with EAGAIN must wait for the descriptor.
+
+bool io61_wants_read(io61_file* f) {
+    return !io61_wants_write(f);
+}
+
+bool io61_wants_write(io61_file* f) {
+    int flags = fcntl(f->fd, F_GETFL);
+    return flags != -1 && (flags & O_ACCMODE) != O_RDONLY;
+}
+
+
 // io61_filesize(f)
 //    Returns the size of `f` in bytes. Returns -1 if `f` does not have a
 //    well-defined size (for instance, if it is a pipe).
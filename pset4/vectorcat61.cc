@@ -0,0 +1,54 @@
+#include "io61.hh"
+
+// Usage: ./vectorcat61 [-b BLOCKSIZE] [-o OUTFILE] [FILE]
+//    Copies the input FILE to OUTFILE in blocks, like a record copier:
+//    each block is read and written as three pieces (a header of up to
+//    16 bytes, a payload, and a trailer of up to 8 bytes) using
+//    `io61_readv` and `io61_writev`. Default BLOCKSIZE is 4096.
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_args args = io61_args("b:o:i:FB:", 4096).parse(argc, argv);
+
+    // Allocate buffer, open files
+    unsigned char* buf = new unsigned char[args.block_size];
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+    args.after_open(inf, O_RDONLY);
+    args.after_open(outf, O_WRONLY);
+
+    // Split the buffer into header, payload, and trailer
+    size_t header = std::min(args.block_size, (size_t) 16);
+    size_t trailer = std::min(args.block_size - header, (size_t) 8);
+    iovec iov[3] = {
+        { buf, header },
+        { buf + header, args.block_size - header - trailer },
+        { buf + args.block_size - trailer, trailer }
+    };
+
+    // Copy file data
+    while (true) {
+        ssize_t nr = io61_readv(inf, iov, 3);
+        if (nr <= 0) {
+            break;
+        }
+
+        // Write the pieces that were read
+        iovec wiov[3];
+        int wiovcnt = 0;
+        for (size_t pos = 0; wiovcnt != 3 && pos < (size_t) nr; ++wiovcnt) {
+            wiov[wiovcnt] = iov[wiovcnt];
+            wiov[wiovcnt].iov_len = std::min(iov[wiovcnt].iov_len, nr - pos);
+            pos += wiov[wiovcnt].iov_len;
+        }
+        ssize_t nw = io61_writev(outf, wiov, wiovcnt);
+        assert(nw == nr);
+
+        args.after_write(outf);
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    delete[] buf;
+}
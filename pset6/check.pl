@@ -292,6 +292,24 @@ my($tt, $info);
 print OUT "\n${Cyan}./ftxxfer check...${Off}\n";
 run_one_check("./ftxxfer", "./diff-ftxdb.pl");
 
+print OUT "\n${Cyan}./ftxxfer -J2 check...${Off}\n";
+run_one_check("./ftxxfer -j6 -J2 -n 50000", "./diff-ftxdb.pl");
+
+print OUT "\n${Cyan}./ftxxfer -U check...${Off}\n";
+run_one_check("./ftxxfer -U -j16 -n 20000", "./diff-ftxdb.pl");
+
+print OUT "\n${Cyan}./ftxxfer -O check...${Off}\n";
+run_one_check("./ftxxfer -O -j6 -J2 -n 20000", "./diff-ftxdb.pl");
+
+print OUT "\n${Cyan}./ftxxfer -W check...${Off}\n";
+run_one_check("./ftxxfer -W -j16 -n 5000", "./diff-ftxdb.pl");
+
+print OUT "\n${Cyan}./ftxxfer -W crash recovery check...${Off}\n";
+run_one_check("timeout -s KILL 1 ./ftxxfer -W -j8 -n 100000000 bigaccounts.fdb; ./ftxxfer -W -M -n 0 /tmp/newaccounts.fdb", "./diff-ftxdb.pl bigaccounts.fdb");
+
+print OUT "\n${Cyan}./ftxxfer -m check...${Off}\n";
+run_one_check("./ftxxfer -m -j6 -J2 -n 20000", "./diff-ftxdb.pl");
+
 print OUT "\n${Cyan}./ftxrocket check...${Off}\n";
 system("make", "SAN=0", "ftxrocket");
 run_one_check("./ftxrocket", "./diff-ftxdb.pl");
@@ -299,13 +317,23 @@ run_one_check("./ftxrocket", "./diff-ftxdb.pl");
 print OUT "\n${Cyan}./ftxrocket -J2 check...${Off}\n";
 run_one_check("./ftxrocket -J2", "./diff-ftxdb.pl");
 
+print OUT "\n${Cyan}./ftxrocket -J8 check...${Off}\n";
+run_one_check("./ftxrocket -j12 -J8 -n 20000", "./diff-ftxdb.pl");
+
 print OUT "\n${Cyan}./ftxblockchain check...${Off}\n";
 system("make", "SAN=0", "ftxblockchain");
 run_one_check("./ftxblockchain", "./diff-ftxdb.pl -l");
 
+print OUT "\n${Cyan}./ftxbackup check...${Off}\n";
+system("make", "SAN=0", "ftxbackup");
+run_one_check("./ftxbackup bigaccounts.fdb", "cmp bigaccounts.fdb /tmp/newaccounts.fdb && ./diff-ftxdb.pl bigaccounts.fdb");
+
 print OUT "\n${Cyan}./ftxxfer bigaccounts.fdb check...${Off}\n";
 run_one_check("./ftxxfer bigaccounts.fdb", "./diff-ftxdb.pl bigaccounts.fdb");
 
+print OUT "\n${Cyan}./ftxxfer -j16 bigaccounts.fdb check...${Off}\n";
+run_one_check("./ftxxfer -j16 -n 25000 bigaccounts.fdb", "./diff-ftxdb.pl bigaccounts.fdb");
+
 
 print OUT "\n${Cyan}Building with sanitizers...${Off}\n";
 system("make", "SAN=1", "ftxxfer");
@@ -320,4 +348,8 @@ run_one_check("./ftxblockchain -n 10000", "./diff-ftxdb.pl -l");
 print OUT "\n${Cyan}./ftxxfer bigaccounts.fdb check...${Off}\n";
 run_one_check("./ftxxfer -n 10000 bigaccounts.fdb", "./diff-ftxdb.pl bigaccounts.fdb");
 
+print OUT "\n${Cyan}./ftxbackup check...${Off}\n";
+system("make", "SAN=1", "ftxbackup");
+run_one_check("./ftxbackup -j2 bigaccounts.fdb", "cmp bigaccounts.fdb /tmp/newaccounts.fdb && ./diff-ftxdb.pl bigaccounts.fdb");
+
 exit(0);
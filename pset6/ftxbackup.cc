@@ -0,0 +1,75 @@
+#include "ftxdb.hh"
+#include <sys/resource.h>
+#include <thread>
+
+// Usage: ./ftxbackup [-j NTHREADS] [-o OUTFILE] [FILE]
+//    Copy the account database FILE to OUTFILE (defaults to
+//    /tmp/newaccounts.fdb) one byte at a time. NTHREADS threads share the
+//    input and output streams: each locks both with `io61_lock_file`,
+//    copies one whole account line with `io61_readc` and `io61_writec`,
+//    and unlocks them, so lines reach OUTFILE intact and in order.
+
+static void copy_thread(io61_file* inf, io61_file* outf, size_t& linecount) {
+    size_t n = 0;
+    while (true) {
+        io61_lock_file(inf);
+        io61_lock_file(outf);
+        int ch = io61_readc(inf);
+        while (ch != EOF) {
+            int r = io61_writec(outf, ch);
+            assert(r == 0);
+            if (ch == '\n') {
+                break;
+            }
+            ch = io61_readc(inf);
+        }
+        io61_unlock_file(outf);
+        io61_unlock_file(inf);
+        if (ch == EOF) {
+            break;
+        }
+        ++n;
+    }
+    linecount = n;
+}
+
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_args args = io61_args("i:o:j:").set_nthreads(4).parse(argc, argv);
+
+    // Open files
+    const char* infile = args.input_file ? args.input_file : "accounts.fdb";
+    const char* outfile = args.output_file ? args.output_file
+        : "/tmp/newaccounts.fdb";
+    io61_file* inf = io61_open_check(infile, O_RDONLY);
+    io61_file* outf = io61_open_check(outfile, O_WRONLY | O_CREAT | O_TRUNC);
+    double start_time = monotonic_timestamp();
+
+    // Run copiers
+    std::vector<std::thread> th(args.nthreads);
+    std::vector<size_t> linecounts(args.nthreads, 0);
+    for (int i = 0; i != args.nthreads; ++i) {
+        th[i] = std::thread(copy_thread, inf, outf, std::ref(linecounts[i]));
+    }
+
+    size_t totallines = 0;
+    for (int i = 0; i != args.nthreads; ++i) {
+        th[i].join();
+        totallines += linecounts[i];
+    }
+
+    // Flush and close
+    io61_close(inf);
+    io61_close(outf);
+
+    double end_time = monotonic_timestamp();
+    struct rusage usage;
+    int r = getrusage(RUSAGE_SELF, &usage);
+    assert(r == 0);
+    fprintf(stderr, "%d %s, %zu %s, %d.%06ds CPU time, %.6fs real time\n",
+            args.nthreads, args.nthreads == 1 ? "thread" : "threads",
+            totallines, totallines == 1 ? "line" : "lines",
+            (int) usage.ru_utime.tv_sec, (int) usage.ru_utime.tv_usec,
+            end_time - start_time);
+}
@@ -3,9 +3,10 @@
 #include <thread>
 #include <mutex>
 
-// Usage: ./ftxblockchain [-j NTHREADS] [-n NOPS] [FILE]
+// Usage: ./ftxblockchain [-j NTHREADS] [-n NOPS] [-m] [FILE]
 //    Perform NOPS * NTHREADS “bank transfers” within FILE, writing
-//    a ledger to LEDGER (defaults to ledger.db).
+//    a ledger to LEDGER (defaults to ledger.db). With `-m`, accounts live
+//    in memory until exit.
 
 static io61_file* ledgerf;
 
@@ -26,11 +27,11 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
             continue;
         }
 
-        // Lock both accounts; prevent deadlock with lock ordering
+        // Lock both accounts at once; io61_lock_many prevents deadlock
         ftx_acct acct1{db, aindex[0]};
         ftx_acct acct2{db, aindex[1]};
-        std::unique_lock guard1{aindex[0] < aindex[1] ? acct1 : acct2};
-        std::unique_lock guard2{aindex[0] < aindex[1] ? acct2 : acct1};
+        ftx_acct_pair accts{acct1, acct2};
+        std::unique_lock guard{accts};
 
         // Read current balances
         char name1[16], name2[16];
@@ -68,7 +69,7 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("i:D:j:n:").set_nthreads(4)
+    io61_args args = io61_args("i:D:j:n:m").set_nthreads(4)
         .set_noperations(100'000)
         .parse(argc, argv);
 
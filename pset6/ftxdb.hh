@@ -1,11 +1,27 @@
 #ifndef FTXDB_HH
 #define FTXDB_HH
 #include "io61.hh"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <mutex>
 #include <random>
 #include <stdexcept>
+#include <system_error>
 #include <utility>
 struct ftx_acct;
+struct ftx_wal;
+struct ftx_memacct;
+
+
+// ftx_update
+//    A new balance for an account, one part of a committed transaction.
+
+struct ftx_update {
+    const ftx_acct* acct;
+    long balance;
+};
 
 
 // ftx_db
@@ -18,10 +34,82 @@ struct ftx_db {
     size_t balance_offset = 8; // offset of balance field within record
     size_t balance_size = 7;   // size of balance field within record
     static constexpr size_t max_asize = 512; // maximum asize allowed
+    ftx_wal* wal = nullptr;    // write-ahead log (`-W`), if any
+    ftx_memacct* mem = nullptr; // in-memory account store (`-m`), if any
+    std::atomic<uint64_t>* versions = nullptr; // per-account write counts
+                               // for optimistic transfers (`-O`), if any
+    long min_balance;          // balances that fit in `balance_size`
+    long max_balance;
 
     ftx_db(io61_file* f);
     ~ftx_db();
     static ftx_db* open_args(const io61_args& args);
+
+    int open_wal(const char* fname);
+    int load_memory();
+    int store_memory();
+    int commit(const ftx_update* updates, size_t n);
+    int checkpoint();
+    void maybe_checkpoint();
+};
+
+
+// ftx_memacct
+//    An account in the in-memory store. With `-m`, the database is loaded
+//    into a packed, cache-line-aligned array of these, indexed by account
+//    number, and transfers read and write balances there without parsing
+//    or formatting. The store is written back to the file in the usual
+//    ASCII format at checkpoint and close.
+
+struct ftx_memacct {
+    int64_t balance;
+    char name[8];              // NUL-padded account name
+};
+
+
+// ftx_walrec
+//    A write-ahead log record: the new balances of one transaction. Records
+//    carry consecutive sequence numbers and a checksum, so recovery can
+//    find the end of the valid log.
+
+struct ftx_walrec {
+    static constexpr size_t max_updates = 2;
+    uint64_t lsn;              // sequence number
+    uint32_t nupdates;         // number of valid `updates`
+    uint32_t checksum;         // `ftx_walrec::compute_checksum()`
+    struct {
+        int64_t offset;        // account record offset
+        int64_t balance;       // new balance
+    } updates[max_updates];
+
+    uint32_t compute_checksum() const;
+};
+
+
+// ftx_wal
+//    Write-ahead log for an `ftx_db`, stored in `DBFILE.wal`. `commit`
+//    appends a record and waits until it is durable; commits that arrive
+//    while another thread is syncing the log are written together by the
+//    next sync (group commit), so a batch costs one `fdatasync`. A
+//    checkpoint makes the database file durable and empties the log.
+
+struct ftx_wal {
+    int fd;                             // log file descriptor
+    std::mutex mutex;                   // protects the fields below
+    std::condition_variable cv;         // signaled when a sync completes
+    std::vector<ftx_walrec> pending;    // records not yet written
+    std::vector<ftx_walrec> batch;      // records being written
+    uint64_t next_lsn = 1;              // sequence number of next record
+    uint64_t durable_lsn = 0;           // last durable sequence number
+    bool syncing = false;               // is a thread writing `batch`?
+    int error = 0;                      // errno of a failed log write
+    std::atomic<off_t> size = 0;        // bytes in log file
+    std::atomic<bool> checkpointing = false;
+    size_t nrecords = 0;                // statistics
+    size_t nsyncs = 0;
+    static constexpr off_t checkpoint_size = 1 << 20;
+
+    int append(const ftx_update* updates, size_t n, const ftx_db& db);
 };
 
 
@@ -30,15 +118,19 @@ struct ftx_db {
 
 struct ftx_acct {
     const ftx_db& db;
+    size_t aindex;
     off_t offset;
     bool locked = false;
 
     inline ftx_acct(const ftx_db& db, size_t aindex);
 
     inline void lock();
+    inline int acquire(int locktype);
     inline void unlock();
     inline int read(char* namebuf, size_t namesz, long* balance) const;
     inline int write(long balance) const;
+    inline int read_versioned(long* balance, uint64_t* version) const;
+    inline uint64_t version() const;
 
     static int parse(
         const char* buf, size_t len, const ftx_db& db,
@@ -50,9 +142,22 @@ struct ftx_acct {
 };
 
 
+// ftx_acct_pair
+//    Two accounts locked and unlocked together with `io61_lock_many`,
+//    so that callers need no lock ordering. Works with `std::unique_lock`.
+
+struct ftx_acct_pair {
+    ftx_acct& acct1;
+    ftx_acct& acct2;
+
+    inline void lock();
+    inline void unlock();
+};
+
+
 // Create an account object for account number `aindex`
-inline ftx_acct::ftx_acct(const ftx_db& db_, size_t aindex)
-    : db(db_) {
+inline ftx_acct::ftx_acct(const ftx_db& db_, size_t aindex_)
+    : db(db_), aindex(aindex_) {
     assert(aindex < this->db.naccounts);
     this->offset = aindex * this->db.asize;
 }
@@ -67,6 +172,16 @@ inline void ftx_acct::lock() {
 }
 
 
+// Lock this account in mode `locktype`; returns 0 on success and -1 on
+// error, such as EDEADLK
+inline int ftx_acct::acquire(int locktype) {
+    assert(!this->locked);
+    int r = io61_lock(this->db.f, this->offset, this->db.asize, locktype);
+    this->locked = r == 0;
+    return r;
+}
+
+
 // Unlock this account
 inline void ftx_acct::unlock() {
     assert(this->locked);
@@ -76,9 +191,51 @@ inline void ftx_acct::unlock() {
 }
 
 
+// Lock both accounts in a single step
+inline void ftx_acct_pair::lock() {
+    assert(!this->acct1.locked && !this->acct2.locked);
+    const ftx_db& db = this->acct1.db;
+    io61_range ranges[2] = {
+        {this->acct1.offset, off_t(db.asize)},
+        {this->acct2.offset, off_t(db.asize)}
+    };
+    int r = io61_lock_many(db.f, ranges, 2, LOCK_EX);
+    assert(r == 0);
+    this->acct1.locked = this->acct2.locked = true;
+}
+
+
+// Unlock both accounts
+inline void ftx_acct_pair::unlock() {
+    assert(this->acct1.locked && this->acct2.locked);
+    const ftx_db& db = this->acct1.db;
+    io61_range ranges[2] = {
+        {this->acct1.offset, off_t(db.asize)},
+        {this->acct2.offset, off_t(db.asize)}
+    };
+    int r = io61_unlock_many(db.f, ranges, 2);
+    assert(r == 0);
+    this->acct1.locked = this->acct2.locked = false;
+}
+
+
 // Read this account’s current name and/or balance, storing the name
 // in `namebuf[0..namesz-1]` and the balance in `*balance`
 inline int ftx_acct::read(char* namebuf, size_t namesz, long* balance) const {
+    // Read account from the in-memory store, if any
+    if (this->db.mem) {
+        const ftx_memacct& m = this->db.mem[this->aindex];
+        if (namebuf && namesz > 0) {
+            size_t len = strnlen(m.name, std::min(namesz - 1, sizeof(m.name)));
+            memcpy(namebuf, m.name, len);
+            namebuf[len] = '\0';
+        }
+        if (balance) {
+            *balance = m.balance;
+        }
+        return 0;
+    }
+
     // Read account from file; short reads are errors
     char buf[ftx_db::max_asize];
     ssize_t nr = io61_pread(this->db.f, buf, this->db.asize, this->offset);
@@ -93,6 +250,22 @@ inline int ftx_acct::read(char* namebuf, size_t namesz, long* balance) const {
 
 // Write `balance` to the account database as this account’s new balance
 inline int ftx_acct::write(long balance) const {
+    // Write to the in-memory store, if any; the balance must still fit
+    // the file format
+    if (this->db.mem) {
+        if (balance < this->db.min_balance || balance > this->db.max_balance) {
+            errno = static_cast<int>(std::errc::value_too_large);
+            return -1;
+        }
+        // optimistic readers load the balance without the lock
+        std::atomic_ref<int64_t>(this->db.mem[this->aindex].balance)
+            .store(balance, std::memory_order_relaxed);
+        if (this->db.versions) {
+            this->db.versions[this->aindex].fetch_add(1, std::memory_order_release);
+        }
+        return 0;
+    }
+
     // Stringify balance to stack buffer
     char buf[ftx_db::max_asize];
     auto [ptr, len] = unparse(buf, sizeof(buf), this->db, balance);
@@ -106,9 +279,36 @@ inline int ftx_acct::write(long balance) const {
     if (size_t(nw) != len) {
         errno = EINVAL;
         return -1;
-    } else {
+    }
+    if (this->db.versions) {
+        this->db.versions[this->aindex].fetch_add(1, std::memory_order_release);
+    }
+    return 0;
+}
+
+
+// Read this account’s balance without holding its lock, storing the
+// balance in `*balance` and the account’s version in `*version`. The
+// balance is at least as new as the version, and may be newer; a caller
+// that later locks the account and finds `version()` unchanged knows the
+// balance is still current.
+inline int ftx_acct::read_versioned(long* balance, uint64_t* version) const {
+    assert(this->db.versions);
+    *version = this->db.versions[this->aindex].load(std::memory_order_acquire);
+    if (this->db.mem) {
+        *balance = std::atomic_ref<int64_t>(this->db.mem[this->aindex].balance)
+            .load(std::memory_order_relaxed);
         return 0;
     }
+    return this->read(nullptr, 0, balance);
+}
+
+
+// Return this account’s version, which changes on every write; the
+// account should be locked
+inline uint64_t ftx_acct::version() const {
+    assert(this->db.versions);
+    return this->db.versions[this->aindex].load(std::memory_order_relaxed);
 }
 
 #endif
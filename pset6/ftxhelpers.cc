@@ -1,6 +1,7 @@
 #include "ftxdb.hh"
 #include <charconv>
 #include <cstdlib>
+#include <string>
 
 ftx_db::ftx_db(io61_file* f_) {
     this->f = f_;
@@ -18,6 +19,16 @@ ftx_db::ftx_db(io61_file* f_) {
 }
 
 ftx_db::~ftx_db() {
+    if (this->wal || this->mem) {
+        int r = this->checkpoint();
+        assert(r == 0);
+    }
+    if (this->wal) {
+        close(this->wal->fd);
+        delete this->wal;
+    }
+    free(this->mem);
+    delete[] this->versions;
     io61_close(this->f);
 }
 
@@ -46,9 +57,315 @@ ftx_db* ftx_db::open_args(const io61_args& args) {
         std::string command = std::string("cp ") + std::string(original) + std::string(" ") + std::string(copy);
         int r = system(command.c_str());
         assert(r == 0);
+        // a log left over from the old copy does not apply to the new one
+        std::string walname = std::string(copy) + ".wal";
+        r = unlink(walname.c_str());
+        assert(r == 0 || errno == ENOENT);
     }
     io61_file* f = io61_open_check(copy, O_RDWR);
-    return new ftx_db(f);
+    ftx_db* db = new ftx_db(f);
+    if (args.wal) {
+        int n = db->open_wal(copy);
+        if (n == -1) {
+            fprintf(stderr, "%s.wal: %s\n", copy, strerror(errno));
+            exit(1);
+        } else if (n > 0) {
+            fprintf(stderr, "%s.wal: recovered %d %s\n", copy, n,
+                    n == 1 ? "transaction" : "transactions");
+        }
+    }
+    if (args.memory && db->load_memory() == -1) {
+        fprintf(stderr, "%s: %s\n", copy, strerror(errno));
+        exit(1);
+    }
+    if (args.optimistic) {
+        db->versions = new std::atomic<uint64_t>[db->naccounts]();
+    }
+    return db;
+}
+
+
+// ftx_db::load_memory()
+//    Loads every account into the in-memory store. From then on, account
+//    reads and writes use the store, and the file is brought up to date
+//    by `checkpoint` and at close. Returns 0 on success and -1 on error.
+
+int ftx_db::load_memory() {
+    assert(!this->mem);
+    // largest and smallest balances `unparse` can format
+    this->max_balance = 0;
+    for (size_t i = 0; i != this->balance_size; ++i) {
+        this->max_balance = this->max_balance * 10 + 9;
+    }
+    this->min_balance = -(this->max_balance / 10);
+
+    size_t sz = this->naccounts * sizeof(ftx_memacct);
+    sz = (sz + 63) & ~size_t(63);
+    auto store = static_cast<ftx_memacct*>(aligned_alloc(64, std::max(sz, size_t(64))));
+    if (!store) {
+        return -1;
+    }
+    for (size_t a = 0; a != this->naccounts; ++a) {
+        ftx_acct acct{*this, a};
+        long balance;
+        memset(store[a].name, 0, sizeof(store[a].name));
+        char name[sizeof(store[a].name) + 1];
+        if (acct.read(name, sizeof(name), &balance) != 0) {
+            free(store);
+            return -1;
+        }
+        memcpy(store[a].name, name, strlen(name));
+        store[a].balance = balance;
+    }
+    this->mem = store;
+    return 0;
+}
+
+
+// ftx_db::store_memory()
+//    Writes every balance in the in-memory store back to the file, in
+//    the ASCII record format. The caller must keep balances from changing,
+//    for instance by locking the whole database. Returns 0 on success and
+//    -1 on error.
+
+int ftx_db::store_memory() {
+    assert(this->mem);
+    char buf[ftx_db::max_asize];
+    for (size_t a = 0; a != this->naccounts; ++a) {
+        auto [ptr, len] = ftx_acct::unparse(buf, sizeof(buf), *this,
+                                            this->mem[a].balance);
+        if (len == 0) {
+            return -1;
+        }
+        off_t off = a * this->asize + this->balance_offset;
+        if (io61_pwrite(this->f, ptr, len, off) != ssize_t(len)) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// ftx_db::open_wal(fname)
+//    Opens the write-ahead log `FNAME.wal` for this database, creating it
+//    if necessary. Any transactions left in the log by a crash are redone
+//    (records hold new balances, so redoing a transaction that already
+//    reached the database is harmless) and checkpointed. Returns the
+//    number of transactions recovered, or -1 on error.
+
+int ftx_db::open_wal(const char* fname) {
+    assert(!this->wal);
+    std::string walname = std::string(fname) + ".wal";
+    int fd = open(walname.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd == -1) {
+        return -1;
+    }
+    this->wal = new ftx_wal;
+    this->wal->fd = fd;
+
+    // Redo the valid prefix of the log; a torn or stale record ends it
+    int nrecovered = 0;
+    off_t limit = this->naccounts * this->asize;
+    ftx_walrec rec;
+    while (pread(fd, &rec, sizeof(rec), nrecovered * sizeof(rec))
+           == ssize_t(sizeof(rec))) {
+        if (rec.checksum != rec.compute_checksum()
+            || (nrecovered > 0 && rec.lsn != this->wal->next_lsn)
+            || rec.nupdates > ftx_walrec::max_updates) {
+            break;
+        }
+        bool valid = true;
+        for (uint32_t i = 0; i != rec.nupdates; ++i) {
+            valid = valid
+                && rec.updates[i].offset >= 0
+                && rec.updates[i].offset < limit
+                && rec.updates[i].offset % this->asize == 0;
+        }
+        if (!valid) {
+            break;
+        }
+        for (uint32_t i = 0; i != rec.nupdates; ++i) {
+            ftx_acct acct{*this, size_t(rec.updates[i].offset / this->asize)};
+            if (acct.write(rec.updates[i].balance) == -1) {
+                return -1;
+            }
+        }
+        this->wal->next_lsn = rec.lsn + 1;
+        ++nrecovered;
+    }
+
+    // Make the redone transactions durable and empty the log
+    this->wal->size = lseek(fd, 0, SEEK_END);
+    if (this->checkpoint() == -1) {
+        return -1;
+    }
+    return nrecovered;
+}
+
+
+// ftx_db::commit(updates, n)
+//    Commits a transaction that sets each account in `updates[0..n-1]` to
+//    its new balance. The caller must hold those accounts' locks. With a
+//    write-ahead log, the transaction is logged and durable before any
+//    balance is written, so a crash can never expose part of it. Returns
+//    0 on success and -1 on error.
+
+int ftx_db::commit(const ftx_update* updates, size_t n) {
+    if (this->wal && this->wal->append(updates, n, *this) == -1) {
+        return -1;
+    }
+    for (size_t i = 0; i != n; ++i) {
+        if (updates[i].acct->write(updates[i].balance) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// ftx_db::checkpoint()
+//    Writes the in-memory store, if any, back to the database file. With
+//    a write-ahead log, also makes every committed balance durable and
+//    empties the log. Takes an exclusive lock on the whole database, so
+//    it waits for transactions in progress; the caller must hold no
+//    account locks. Returns 0 on success and -1 on error.
+
+int ftx_db::checkpoint() {
+    if (!this->wal && !this->mem) {
+        return 0;
+    }
+    off_t dbsize = this->naccounts * this->asize;
+    int r = io61_lock(this->f, 0, dbsize, LOCK_EX);
+    assert(r == 0);
+    // All logged transactions have been applied: each one holds its
+    // account locks from logging until its balances are written.
+    if (this->mem && this->store_memory() == -1) {
+        r = -1;
+    } else if (!this->wal) {
+        // nothing to make durable
+    } else if (io61_flush(this->f) == -1
+               || fdatasync(io61_fileno(this->f)) == -1
+               || ftruncate(this->wal->fd, 0) == -1
+               || fdatasync(this->wal->fd) == -1) {
+        r = -1;
+    } else {
+        this->wal->size = 0;
+    }
+    int ur = io61_unlock(this->f, 0, dbsize);
+    assert(ur == 0);
+    return r;
+}
+
+
+// ftx_db::maybe_checkpoint()
+//    Checkpoints if the log has grown past `ftx_wal::checkpoint_size` and
+//    no other thread is already checkpointing. The caller must hold no
+//    account locks.
+
+void ftx_db::maybe_checkpoint() {
+    if (this->wal
+        && this->wal->size >= ftx_wal::checkpoint_size
+        && !this->wal->checkpointing.exchange(true)) {
+        int r = this->checkpoint();
+        assert(r == 0);
+        this->wal->checkpointing = false;
+    }
+}
+
+
+// ftx_wal::append(updates, n, db)
+//    Appends a record for the transaction `updates[0..n-1]` and waits
+//    until it is durable. If no other thread is writing the log, this
+//    thread becomes the leader: it writes every pending record, including
+//    ones appended by other threads, with a single `fdatasync`, then
+//    wakes the threads whose records that made durable. Returns 0 on
+//    success and -1 on error.
+
+int ftx_wal::append(const ftx_update* updates, size_t n, const ftx_db& db) {
+    assert(n <= ftx_walrec::max_updates);
+    ftx_walrec rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.nupdates = n;
+    for (size_t i = 0; i != n; ++i) {
+        rec.updates[i].offset = updates[i].acct->offset;
+        rec.updates[i].balance = updates[i].balance;
+        assert(&updates[i].acct->db == &db);
+    }
+
+    std::unique_lock guard(this->mutex);
+    rec.lsn = this->next_lsn;
+    ++this->next_lsn;
+    rec.checksum = rec.compute_checksum();
+    this->pending.push_back(rec);
+    while (this->durable_lsn < rec.lsn && this->error == 0) {
+        if (this->syncing) {
+            this->cv.wait(guard);
+            continue;
+        }
+
+        // Lead a group commit
+        this->syncing = true;
+        this->batch.swap(this->pending);
+        uint64_t last_lsn = this->batch.back().lsn;
+        off_t off = this->size;
+        size_t len = this->batch.size() * sizeof(ftx_walrec);
+        guard.unlock();
+
+        const char* data = reinterpret_cast<const char*>(this->batch.data());
+        size_t nwritten = 0;
+        int err = 0;
+        while (nwritten != len && err == 0) {
+            ssize_t nw = pwrite(this->fd, data + nwritten, len - nwritten,
+                                off + nwritten);
+            if (nw > 0) {
+                nwritten += nw;
+            } else if (nw == -1 && errno != EINTR) {
+                err = errno;
+            }
+        }
+        if (err == 0 && fdatasync(this->fd) == -1) {
+            err = errno;
+        }
+
+        guard.lock();
+        this->syncing = false;
+        ++this->nsyncs;
+        if (err != 0) {
+            // a failed write or sync leaves the log unknown; refuse
+            // further commits, and keep `size` at the end of the last
+            // durable record so that any later write overwrites the
+            // torn one instead of following it
+            this->error = err;
+        } else {
+            this->size = off + len;
+            this->nrecords += this->batch.size();
+            this->durable_lsn = last_lsn;
+        }
+        this->batch.clear();
+        this->cv.notify_all();
+    }
+    if (this->durable_lsn < rec.lsn) {
+        errno = this->error;
+        return -1;
+    }
+    return 0;
+}
+
+
+// ftx_walrec::compute_checksum()
+//    Returns a checksum (FNV-1a) of this record, not counting its
+//    `checksum` field.
+
+uint32_t ftx_walrec::compute_checksum() const {
+    ftx_walrec copy = *this;
+    copy.checksum = 0;
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(&copy);
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i != sizeof(copy); ++i) {
+        h = (h ^ p[i]) * 16777619U;
+    }
+    return h;
 }
 
 
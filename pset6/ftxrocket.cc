@@ -2,13 +2,99 @@
 #include <sys/resource.h>
 #include <thread>
 #include <mutex>
+#include <atomic>
 
-// Usage: ./ftxrocket [-j NTHREADS] [-n NOPS] [FILE]
+// Usage: ./ftxrocket [-j NTHREADS] [-J NSBFTHREADS] [-n NOPS] [-m] [FILE]
 //    Perform NOPS * NTHREADS “bank transfers” within FILE, completely
-//    legally.
+//    legally. The first NSBFTHREADS threads mostly move money among
+//    accounts 0–2. With `-m`, accounts live in memory until exit.
 
-static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
-                            unsigned seed) {
+
+// hot_accounts
+//    Flat combining for transfers among a few hot accounts. A thread
+//    publishes its transfer in its own request slot, then takes the
+//    combiner mutex. Whichever thread holds it applies every published
+//    transfer in one batch: one range lock, one read and one write per
+//    account, however many transfers. By the time most threads get the
+//    mutex, an earlier combiner has already applied their transfer.
+
+struct alignas(64) hot_request {
+    size_t from;                        // hot account indexes
+    size_t to;
+    long amount;                        // amount requested
+    std::atomic<bool> pending = false;  // set until a combiner applies it
+};
+
+struct hot_accounts {
+    static constexpr size_t naccounts = 3;  // accounts 0–2
+    ftx_db& db;
+    std::mutex combiner;
+    std::vector<hot_request> requests;      // one per thread
+    std::vector<hot_request*> batch;        // protected by `combiner`
+
+    hot_accounts(ftx_db& db_, int nthreads)
+        : db(db_), requests(nthreads) {
+    }
+
+    bool contains(size_t aindex) const {
+        return aindex < naccounts;
+    }
+    void transfer(size_t tid, size_t from, size_t to, long amount);
+    void combine();
+};
+
+
+// Move up to `amount` from hot account `from` to hot account `to` on
+// behalf of thread `tid`; returns once the transfer has been applied
+void hot_accounts::transfer(size_t tid, size_t from, size_t to,
+                            long amount) {
+    hot_request& req = this->requests[tid];
+    req.from = from;
+    req.to = to;
+    req.amount = amount;
+    req.pending.store(true, std::memory_order_release);
+    std::lock_guard guard(this->combiner);
+    if (req.pending.load(std::memory_order_acquire)) {
+        this->combine();
+    }
+}
+
+
+// Apply every published transfer; `combiner` must be held
+void hot_accounts::combine() {
+    off_t len = this->naccounts * this->db.asize;
+    int r = io61_lock(this->db.f, 0, len, LOCK_EX);
+    assert(r == 0);
+
+    long bal[naccounts];
+    for (size_t a = 0; a != naccounts; ++a) {
+        r = ftx_acct{this->db, a}.read(nullptr, 0, &bal[a]);
+        assert(r == 0);
+    }
+    this->batch.clear();
+    for (auto& req : this->requests) {
+        if (req.pending.load(std::memory_order_acquire)) {
+            long delta = std::min(bal[req.from], req.amount);
+            delta = std::min(delta, 9999999 - bal[req.to]);
+            bal[req.from] -= delta;
+            bal[req.to] += delta;
+            this->batch.push_back(&req);
+        }
+    }
+    for (size_t a = 0; a != naccounts; ++a) {
+        r = ftx_acct{this->db, a}.write(bal[a]);
+        assert(r == 0);
+    }
+
+    r = io61_unlock(this->db.f, 0, len);
+    assert(r == 0);
+    for (auto req : this->batch) {
+        req->pending.store(false, std::memory_order_release);
+    }
+}
+
+static void transfer_thread(ftx_db& db, hot_accounts& hot, size_t tid,
+                            size_t nops, size_t& opcount, unsigned seed) {
     // Obtain a source of random account numbers
     std::default_random_engine randomness(seed);
     std::uniform_int_distribution pick_account(size_t(0), db.naccounts - 1);
@@ -24,11 +110,20 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
             continue;
         }
 
-        // Lock both accounts; prevent deadlock with lock ordering
+        // Transfers between hot accounts go through the combiner
+        if (hot.contains(aindex[0]) && hot.contains(aindex[1])) {
+            usleep(1);
+            hot.transfer(tid, aindex[0], aindex[1],
+                         (long) pick_amount(randomness));
+            ++i;
+            continue;
+        }
+
+        // Lock both accounts at once; io61_lock_many prevents deadlock
         ftx_acct acct1{db, aindex[0]};
         ftx_acct acct2{db, aindex[1]};
-        std::unique_lock guard1{aindex[0] < aindex[1] ? acct1 : acct2};
-        std::unique_lock guard2{aindex[0] < aindex[1] ? acct2 : acct1};
+        ftx_acct_pair accts{acct1, acct2};
+        std::unique_lock guard{accts};
 
         // Read current balances
         long bal[2];
@@ -54,7 +149,8 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
 }
 
 
-static void sbf_transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
+static void sbf_transfer_thread(ftx_db& db, hot_accounts& hot, size_t tid,
+                                size_t nops, size_t& opcount,
                                 unsigned seed) {
     // Obtain a source of random account numbers
     std::default_random_engine randomness(seed);
@@ -81,11 +177,21 @@ static void sbf_transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
             aindex[1] = pick_sbf_account(randomness);
         }
 
-        // Lock both accounts; prevent deadlock with lock ordering
+        // Internal transfers go through the combiner: model the delay
+        // first, then let one thread apply a whole batch under one lock
+        if (internal_transfer) {
+            usleep(1);
+            hot.transfer(tid, aindex[0], aindex[1],
+                         (long) pick_amount(randomness));
+            ++i;
+            continue;
+        }
+
+        // Lock both accounts at once; io61_lock_many prevents deadlock
         ftx_acct acct1{db, aindex[0]};
         ftx_acct acct2{db, aindex[1]};
-        std::unique_lock guard1{aindex[0] < aindex[1] ? acct1 : acct2};
-        std::unique_lock guard2{aindex[0] < aindex[1] ? acct2 : acct1};
+        ftx_acct_pair accts{acct1, acct2};
+        std::unique_lock guard{accts};
 
         // Read current balances
         long bal[2];
@@ -113,7 +219,7 @@ static void sbf_transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("i:D:j:J:n:").set_nthreads(4)
+    io61_args args = io61_args("i:D:j:J:n:m").set_nthreads(4)
         .set_noperations(100'000)
         .set_ndistinguished_threads(1)
         .parse(argc, argv);
@@ -125,17 +231,18 @@ int main(int argc, char* argv[]) {
     double start_time = monotonic_timestamp();
 
     // Run transfers
+    hot_accounts hot(*db, args.nthreads);
     std::vector<std::thread> th(args.nthreads);
     std::vector<size_t> opcounts(args.nthreads, 0);
     for (int i = 0; i != args.nthreads; ++i) {
         if (i < args.ndistinguished_threads) {
             th[i] = std::thread(sbf_transfer_thread, std::ref(*db),
-                                args.noperations, std::ref(opcounts[i]),
-                                seed_randomness());
+                                std::ref(hot), i, args.noperations,
+                                std::ref(opcounts[i]), seed_randomness());
         } else {
             th[i] = std::thread(transfer_thread, std::ref(*db),
-                                args.noperations, std::ref(opcounts[i]),
-                                seed_randomness());
+                                std::ref(hot), i, args.noperations,
+                                std::ref(opcounts[i]), seed_randomness());
         }
     }
 
@@ -2,12 +2,82 @@
 #include <sys/resource.h>
 #include <thread>
 #include <mutex>
+#include <atomic>
 
-// Usage: ./ftxxfer [-j NTHREADS] [-n NOPS] [FILE]
-//    Perform NOPS * NTHREADS “bank transfers” within FILE.
+// Usage: ./ftxxfer [-j NTHREADS] [-J NAUDITORS] [-n NOPS] [-U] [-O] [-W]
+//                 [-M] [-m] [FILE]
+//    Perform NOPS * NTHREADS “bank transfers” within FILE. The first
+//    NAUDITORS threads instead repeatedly audit the database under a
+//    shared lock, checking that transfers preserve the total balance,
+//    until the transfer threads finish. With `-U`, transfers lock their
+//    accounts in whatever order they were picked and back off when
+//    io61_lock reports a deadlock. With `-O`, transfers read and compute
+//    without locks, then lock both accounts only to check that neither
+//    changed and to commit, retrying on conflict. With `-W`, transfers
+//    commit durably through the write-ahead log `FILE.wal`, and opening
+//    the database recovers any transfers a crash left in the log; `-M`
+//    updates FILE itself rather than a copy. With `-m`, accounts live in
+//    memory as binary balances and are written back to FILE at
+//    checkpoint and exit.
 
-static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
-                            unsigned seed) {
+// Lock `acct1` then `acct2`, retrying whenever io61 detects a deadlock;
+// returns the number of retries
+static size_t lock_unordered(ftx_acct& acct1, ftx_acct& acct2) {
+    size_t nretries = 0;
+    while (true) {
+        acct1.lock();
+        if (acct2.acquire(LOCK_EX) == 0) {
+            return nretries;
+        }
+        assert(errno == EDEADLK);
+        acct1.unlock();
+        ++nretries;
+        sched_yield();
+    }
+}
+
+
+// Transfer between `acct1` and `acct2` optimistically: read balances and
+// versions without locks, compute, then lock both accounts, and commit
+// only if neither version changed; otherwise start over. Returns the
+// number of aborted attempts.
+static size_t transfer_optimistic(ftx_db& db, ftx_acct& acct1,
+                                  ftx_acct& acct2, std::mt19937& randomness,
+                                  std::normal_distribution<>& pick_amount) {
+    size_t naborts = 0;
+    while (true) {
+        // Read current balances and versions
+        long bal[2];
+        uint64_t ver[2];
+        acct1.read_versioned(&bal[0], &ver[0]);
+        acct2.read_versioned(&bal[1], &ver[1]);
+
+        // Model network delay or heavy computation
+        usleep(1);
+
+        // Compute amount to transfer
+        long delta = std::min(bal[0], (long) pick_amount(randomness));
+        delta = std::min(delta, 9999999 - bal[1]);
+        bal[0] -= delta;
+        bal[1] += delta;
+
+        // Validate and update balances
+        ftx_acct_pair accts{acct1, acct2};
+        std::unique_lock guard{accts};
+        if (acct1.version() == ver[0] && acct2.version() == ver[1]) {
+            ftx_update updates[2] = {{&acct1, bal[0]}, {&acct2, bal[1]}};
+            int r = db.commit(updates, 2);
+            assert(r == 0);
+            return naborts;
+        }
+        ++naborts;
+    }
+}
+
+
+static void transfer_thread(ftx_db& db, size_t nops, bool unordered,
+                            size_t& opcount, size_t& ndeadlocks,
+                            size_t& naborts, unsigned seed) {
     // Obtain a source of random account numbers
     std::mt19937 randomness(seed);
     std::uniform_int_distribution pick_account(size_t(0), db.naccounts - 1);
@@ -15,6 +85,9 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
 
     size_t i = 0;
     while (i != nops) {
+        // Keep the write-ahead log short; must hold no locks
+        db.maybe_checkpoint();
+
         // Pick two random accounts for transfer
         size_t aindex[2] = {
             pick_account(randomness), pick_account(randomness)
@@ -23,11 +96,27 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
             continue;
         }
 
-        // Lock both accounts; prevent deadlock with lock ordering
         ftx_acct acct1{db, aindex[0]};
         ftx_acct acct2{db, aindex[1]};
-        std::unique_lock guard1{aindex[0] < aindex[1] ? acct1 : acct2};
-        std::unique_lock guard2{aindex[0] < aindex[1] ? acct2 : acct1};
+        if (db.versions) {
+            naborts += transfer_optimistic(db, acct1, acct2, randomness,
+                                           pick_amount);
+            ++i;
+            continue;
+        }
+
+        // Lock both accounts at once, or, with `-U`, one at a time in
+        // any order, detecting deadlock and retrying
+        ftx_acct_pair accts{acct1, acct2};
+        std::unique_lock<ftx_acct> guard1, guard2;
+        std::unique_lock<ftx_acct_pair> guard;
+        if (unordered) {
+            ndeadlocks += lock_unordered(acct1, acct2);
+            guard1 = std::unique_lock{acct1, std::adopt_lock};
+            guard2 = std::unique_lock{acct2, std::adopt_lock};
+        } else {
+            guard = std::unique_lock{accts};
+        }
 
         // Read current balances
         long bal[2];
@@ -44,8 +133,9 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
         bal[1] += delta;
 
         // Update balances
-        acct1.write(bal[0]);
-        acct2.write(bal[1]);
+        ftx_update updates[2] = {{&acct1, bal[0]}, {&acct2, bal[1]}};
+        int r = db.commit(updates, 2);
+        assert(r == 0);
 
         ++i;
     }
@@ -53,9 +143,40 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
 }
 
 
+// Return the sum of all account balances, read under a shared lock
+static long audit(ftx_db& db) {
+    off_t dbsize = db.naccounts * db.asize;
+    int r = io61_lock(db.f, 0, dbsize, LOCK_SH);
+    assert(r == 0);
+    long total = 0;
+    for (size_t a = 0; a != db.naccounts; ++a) {
+        ftx_acct acct{db, a};
+        long bal;
+        r = acct.read(nullptr, 0, &bal);
+        assert(r == 0);
+        total += bal;
+    }
+    r = io61_unlock(db.f, 0, dbsize);
+    assert(r == 0);
+    return total;
+}
+
+
+static void audit_thread(ftx_db& db, long total,
+                         const std::atomic<bool>& done, size_t& auditcount) {
+    size_t i = 0;
+    do {
+        long t = audit(db);
+        assert(t == total);
+        ++i;
+    } while (!done);
+    auditcount = i;
+}
+
+
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("i:D:j:n:").set_nthreads(4)
+    io61_args args = io61_args("i:D:j:J:n:UOWMm").set_nthreads(4)
         .set_noperations(100'000)
         .parse(argc, argv);
 
@@ -65,22 +186,44 @@ int main(int argc, char* argv[]) {
     std::random_device seed_randomness;
     double start_time = monotonic_timestamp();
 
-    // Run transfers
+    // Run transfers and audits
+    long total = audit(*db);
+    std::atomic<bool> done = false;
     std::vector<std::thread> th(args.nthreads);
     std::vector<size_t> opcounts(args.nthreads, 0);
+    std::vector<size_t> deadlocks(args.nthreads, 0);
+    std::vector<size_t> aborts(args.nthreads, 0);
     for (int i = 0; i != args.nthreads; ++i) {
-        th[i] = std::thread(transfer_thread, std::ref(*db),
-                            args.noperations, std::ref(opcounts[i]),
-                            seed_randomness());
+        if (i < args.ndistinguished_threads) {
+            th[i] = std::thread(audit_thread, std::ref(*db), total,
+                                std::cref(done), std::ref(opcounts[i]));
+        } else {
+            th[i] = std::thread(transfer_thread, std::ref(*db),
+                                args.noperations, args.unordered,
+                                std::ref(opcounts[i]), std::ref(deadlocks[i]),
+                                std::ref(aborts[i]), seed_randomness());
+        }
     }
 
-    size_t totalops = 0;
-    for (int i = 0; i != args.nthreads; ++i) {
+    size_t totalops = 0, totalaudits = 0, totaldeadlocks = 0, totalaborts = 0;
+    for (int i = args.ndistinguished_threads; i != args.nthreads; ++i) {
         th[i].join();
         totalops += opcounts[i];
+        totaldeadlocks += deadlocks[i];
+        totalaborts += aborts[i];
+    }
+    done = true;
+    for (int i = 0; i != args.ndistinguished_threads; ++i) {
+        th[i].join();
+        totalaudits += opcounts[i];
     }
 
     // Flush and close
+    size_t nrecords = 0, nsyncs = 0;
+    if (db->wal) {
+        nrecords = db->wal->nrecords;
+        nsyncs = db->wal->nsyncs;
+    }
     delete db;
 
     double end_time = monotonic_timestamp();
@@ -92,4 +235,22 @@ int main(int argc, char* argv[]) {
             totalops, totalops == 1 ? "operation" : "operations",
             (int) usage.ru_utime.tv_sec, (int) usage.ru_utime.tv_usec,
             end_time - start_time);
+    if (args.ndistinguished_threads > 0) {
+        fprintf(stderr, "%zu %s\n", totalaudits,
+                totalaudits == 1 ? "audit" : "audits");
+    }
+    if (args.unordered) {
+        fprintf(stderr, "%zu %s detected\n", totaldeadlocks,
+                totaldeadlocks == 1 ? "deadlock" : "deadlocks");
+    }
+    if (args.optimistic) {
+        fprintf(stderr, "%zu %s (%.2f%% of attempts)\n", totalaborts,
+                totalaborts == 1 ? "abort" : "aborts",
+                100.0 * totalaborts / std::max(totalops + totalaborts, size_t(1)));
+    }
+    if (args.wal) {
+        fprintf(stderr, "%zu %s logged in %zu %s\n", nrecords,
+                nrecords == 1 ? "transaction" : "transactions",
+                nsyncs, nsyncs == 1 ? "sync" : "syncs");
+    }
 }
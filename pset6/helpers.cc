@@ -201,6 +201,18 @@ io61_args& io61_args::parse(int argc, char** argv) {
             this->ndistinguished_threads = n;
             break;
         }
+        case 'U':
+            this->unordered = true;
+            break;
+        case 'W':
+            this->wal = true;
+            break;
+        case 'm':
+            this->memory = true;
+            break;
+        case 'O':
+            this->optimistic = true;
+            break;
         case 'n':
             this->noperations = (size_t) strtoul(optarg, &endptr, 0);
             if (endptr == optarg || *endptr) {
@@ -316,6 +328,18 @@ void io61_args::usage() {
     if (strchr(this->opts, 'n')) {
         fprintf(stderr, "    -n N          Perform N operations\n");
     }
+    if (strchr(this->opts, 'U')) {
+        fprintf(stderr, "    -U            Lock without ordering; retry on deadlock\n");
+    }
+    if (strchr(this->opts, 'W')) {
+        fprintf(stderr, "    -W            Commit through a write-ahead log\n");
+    }
+    if (strchr(this->opts, 'm')) {
+        fprintf(stderr, "    -m            Keep accounts in memory; write back at close\n");
+    }
+    if (strchr(this->opts, 'O')) {
+        fprintf(stderr, "    -O            Transfer optimistically; retry on conflict\n");
+    }
     if (strchr(this->opts, 'M')) {
         fprintf(stderr, "    -M            Modify input file in place\n");
     }
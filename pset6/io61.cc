@@ -1,93 +1,158 @@
 #include "io61.hh"
 #include <climits>
 #include <cerrno>
+#include <atomic>
 #include <mutex>
 #include <shared_mutex>
 #include <condition_variable>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <thread>
+#include <map>
+#include <list>
+#include <deque>
+#include <algorithm>
+#include <memory>
 
 // io61.cc
-#define FINELOCKSIZE 16 // size of region locks
 
-// io61_file
-//    Data structure for io61 file wrappers.
+// io61_lockseg
+//    A run of bytes whose lock holders are all the same.
+//    `io61_file::locks` maps each segment's start offset to the segment.
+//    Segments never overlap, and unlocked bytes have no segment at all.
+//    A segment has either an exclusive owner, shared holders, or (when
+//    the exclusive owner has upgraded a shared lock) both, with the
+//    owner as the only shared holder.
+
+struct io61_sharer {
+    std::thread::id owner;  // shared holder
+    unsigned locked;        // number of shared locks it holds
 
-struct map_region {
-    int reg_num;            // region values from file_region()
-    std::thread::id owner;  // owner of region
-    unsigned locked;        // number of times locked
+    bool operator==(const io61_sharer& x) const {
+        return owner == x.owner && locked == x.locked;
+    }
 };
 
-struct io61_file {
-    int fd = -1;     // file descriptor
-    int mode;        // O_RDONLY, O_WRONLY, or O_RDWR
-    bool seekable;   // is this file seekable?
+struct io61_lockseg {
+    off_t end;                          // offset one past last byte
+    std::thread::id owner;              // exclusive owner, if `locked > 0`
+    unsigned locked = 0;                // number of exclusive locks held
+    std::vector<io61_sharer> sharers;   // shared holders, sorted by owner
 
-    // Single-slot cache
-    static constexpr off_t cbufsz = 8192;
-    unsigned char cbuf[cbufsz];
-    off_t tag;       // offset of first character in `cbuf`
-    off_t pos_tag;   // next offset to read or write (non-positioned mode)
-    off_t end_tag;   // offset one past last valid character in `cbuf`
+    explicit io61_lockseg(off_t end_)
+        : end(end_) {
+    }
+};
+
+using io61_lockmap = std::map<off_t, io61_lockseg>;
+
+
+// io61_lockwaiter
+//    A thread blocked in `io61_lock`. The record lives on the blocked
+//    thread's stack; whoever grants the lock removes it from the wait
+//    queue, records the lock on the waiter's behalf, and signals `cv`.
 
-    // Positioned mode
-    std::atomic<bool> dirty = false;       // has cache been written?
-    bool positioned = false;  // is cache in positioned mode?
-    std::recursive_mutex mutex;
-    std::condition_variable_any cv;
-    std::vector<map_region> rmap; // stores the region numbers, ID, and num of locks
+struct io61_lockwaiter {
+    const io61_range* ranges;       // requested ranges, sorted, disjoint
+    size_t nranges;
+    std::thread::id owner;
+    int locktype;
+    bool granted = false;
+    std::condition_variable cv;     // signaled when `granted` is set
 
+    io61_lockwaiter(const io61_range* ranges_, size_t nranges_, int locktype_)
+        : ranges(ranges_), nranges(nranges_),
+          owner(std::this_thread::get_id()), locktype(locktype_) {
+    }
 };
 
-// static int file_region(off)
-//    calculates region number of file that off falls in
+using io61_waitqueue = std::list<io61_lockwaiter*>;
 
-static int file_region(off_t off) {
-    return (int) (off/FINELOCKSIZE);
-}
 
+// io61_pslot
+//    One block of the positioned-mode cache. Each slot has its own latch,
+//    so positioned I/O on different slots runs in parallel.
 
-// int find(map, n)
-//    Returns the index of region that has region values from file_region() n.
-//    Returns -1 if not found
+struct io61_wbblock;
 
-int find(std::vector<map_region> map, int n) {
-    for (int i = 0; (size_t)i < map.size(); i++) {
-        if (map.at(i).reg_num == n) return i;
-    }
-    return -1;
-}
+struct alignas(64) io61_pslot {
+    static constexpr off_t bufsz = 8192;
+    std::mutex latch;       // protects the rest of the slot
+    off_t tag = -1;         // file offset of `buf[0]`, or -1 if empty
+    off_t end_tag = -1;     // offset one past last valid byte in `buf`
+    bool dirty = false;     // has `buf` been written?
+    io61_wbblock* wb = nullptr;     // evicted block not yet written back
+    std::condition_variable wb_cv;  // signaled when `wb` is cleared
+    unsigned char buf[bufsz];
+};
 
 
-// bool may_overlap_with_other_lock(f, start, len)
-//    returns whether a new lock at [start, start+len) would overlap with
-//    a lock from a different thread
-//    overlapping locks in the same thread are fine; in this case, the
-//    'locked' attribute would be >1
+// io61_wbblock
+//    A dirty block evicted from a positioned-mode slot and queued for the
+//    writeback thread. Nothing modifies `buf` while the block is queued,
+//    so the slot can still copy from it if the block is read again.
 
-bool may_overlap_with_other_lock(io61_file* f, off_t start, off_t len) {
-    int rstart = file_region(start);
-    int rend = file_region(start + len - 1);
+struct io61_wbblock {
+    io61_pslot* slot;       // slot the block was evicted from
+    off_t tag;              // file offset of `buf[0]`
+    off_t end_tag;          // offset one past last valid byte in `buf`
+    unsigned char buf[io61_pslot::bufsz];
+};
 
-    for (int ri = rstart; ri <= rend; ++ri) {
 
-        // find index of the region with reg_num ri
-        int find_index = find(f->rmap, ri);
-        if (find_index == -1) {
-            // if doesn't exist (no overlap issue), insert 
-            f->rmap.push_back({ri, std::this_thread::get_id(), 0});
-        }
-        else {
-            auto region = f->rmap.at(find_index);
-            if (region.locked > 0 && region.owner != std::this_thread::get_id()) {
-                return true;
-            }
-        }
-    }
-    return false;
-}
+// io61_file
+//    Data structure for io61 file wrappers.
+
+struct io61_file {
+    int fd = -1;     // file descriptor
+    int mode;        // O_RDONLY, O_WRONLY, or O_RDWR
+    bool seekable;   // is this file seekable?
+
+    // Single-slot cache for non-positioned mode
+    static constexpr off_t cbufsz = 8192;
+    unsigned char cbuf[cbufsz];
+    off_t tag;       // offset of first character in `cbuf`
+    off_t pos_tag;   // next offset to read or write (non-positioned mode)
+    off_t end_tag;   // offset one past last valid character in `cbuf`
+    bool dirty = false;     // has `cbuf` been written?
+
+    // Stream lock (non-positioned mode). `owner` is the thread holding
+    // `mutex`; a thread that already owns the stream, e.g. through
+    // `io61_lock_file`, skips `mutex` entirely.
+    std::mutex mutex;
+    std::atomic<const void*> owner = nullptr;  // `&io61_self` of holder
+    unsigned owner_depth = 0;   // nesting depth, accessed only by `owner`
+
+    // Positioned mode: a direct-mapped cache of `npslots` blocks. Block
+    // number `b` lives in slot `b % npslots`, so finding a slot needs no
+    // lock; only the slot's own latch is taken. The slots (half a
+    // megabyte) are allocated by the first positioned access, so files
+    // used only as streams never pay for them.
+    static constexpr size_t npslots = 64;
+    std::atomic<bool> positioned = false;  // has positioned I/O happened?
+    std::once_flag pslots_once;            // allocates `pslots`
+    std::unique_ptr<io61_pslot[]> pslots;  // null until then
+
+    // Background writeback of evicted dirty blocks. At most `nwbblocks`
+    // evicted blocks are outstanding; past that, eviction writes the
+    // block itself. Each slot has at most one block outstanding, so
+    // writes to any one block reach the file in order.
+    static constexpr size_t nwbblocks = 16;
+    std::mutex wb_mutex;                // protects the fields below
+    std::condition_variable wb_cv;      // signaled on new work or stop
+    std::vector<io61_wbblock> wbblocks; // allocated with `wb_thread`
+    std::vector<io61_wbblock*> wb_free; // blocks not in use
+    std::deque<io61_wbblock*> wb_queue; // blocks waiting to be written
+    bool wb_stop = false;               // should `wb_thread` exit?
+    int wb_error = 0;                   // errno from a failed writeback
+    std::thread wb_thread;
+
+    // Range locks
+    std::mutex lock_mutex;          // protects the fields below
+    io61_lockmap locks;             // locked segments by start offset
+    io61_waitqueue lock_waiters;    // blocked lock requests, FIFO
+    std::map<std::thread::id, size_t> lock_nheld; // segments each holds
+};
 
 
 // io61_fdopen(fd, mode)
@@ -109,7 +174,6 @@ io61_file* io61_fdopen(int fd, int mode) {
         f->seekable = false;
         f->tag = f->pos_tag = f->end_tag = 0;
     }
-    f->dirty = f->positioned = false;
     return f;
 }
 
@@ -117,14 +181,75 @@ io61_file* io61_fdopen(int fd, int mode) {
 // io61_close(f)
 //    Closes the io61_file `f` and releases all its resources.
 
+static void io61_writeback_stop(io61_file* f);
+
 int io61_close(io61_file* f) {
     io61_flush(f);
+    io61_writeback_stop(f);
     int r = close(f->fd);
     delete f;
     return r;
 }
 
 
+// STREAM LOCKING
+
+// io61_self
+//    A per-thread object whose address identifies the calling thread.
+//    Cheaper to obtain than `std::this_thread::get_id()`.
+
+static thread_local char io61_self;
+
+
+// io61_lock_file(f), io61_unlock_file(f)
+//    Lock and unlock the non-positioned stream state of `f`, like
+//    `flockfile` and `funlockfile`. Locks nest. While a thread holds the
+//    stream lock, its io61_read, io61_readc, io61_write, io61_writec,
+//    io61_seek, and io61_flush calls on `f` take no mutex at all, and
+//    other threads' stream calls block. A thread that is the only user of
+//    a stream can lock it once after opening and read byte-at-a-time at
+//    single-threaded speed.
+
+void io61_lock_file(io61_file* f) {
+    // Only this thread can store its own identity into `owner`, so a
+    // relaxed load that sees it is reliable.
+    if (f->owner.load(std::memory_order_relaxed) == &io61_self) {
+        ++f->owner_depth;
+        return;
+    }
+    f->mutex.lock();
+    f->owner.store(&io61_self, std::memory_order_relaxed);
+    f->owner_depth = 1;
+}
+
+void io61_unlock_file(io61_file* f) {
+    assert(f->owner.load(std::memory_order_relaxed) == &io61_self
+           && f->owner_depth > 0);
+    if (--f->owner_depth == 0) {
+        f->owner.store(nullptr, std::memory_order_relaxed);
+        f->mutex.unlock();
+    }
+}
+
+
+// io61_stream_guard
+//    Holds the stream lock for the duration of one stream call.
+
+struct io61_stream_guard {
+    io61_file* f;
+
+    explicit io61_stream_guard(io61_file* f_)
+        : f(f_) {
+        io61_lock_file(f);
+    }
+    ~io61_stream_guard() {
+        io61_unlock_file(f);
+    }
+    io61_stream_guard(const io61_stream_guard&) = delete;
+    io61_stream_guard& operator=(const io61_stream_guard&) = delete;
+};
+
+
 // NORMAL READING AND WRITING FUNCTIONS
 
 // io61_readc(f)
@@ -135,7 +260,14 @@ static int io61_fill(io61_file* f);
 
 int io61_readc(io61_file* f) {
     assert(!f->positioned);
-    f->mutex.lock();
+    // Fast path: the stream is already ours and the byte is cached
+    if (f->owner.load(std::memory_order_relaxed) == &io61_self
+        && f->pos_tag != f->end_tag) {
+        unsigned char ch = f->cbuf[f->pos_tag - f->tag];
+        ++f->pos_tag;
+        return ch;
+    }
+    io61_stream_guard guard(f);
     if (f->pos_tag == f->end_tag) {
         io61_fill(f);
         if (f->pos_tag == f->end_tag) {
@@ -144,7 +276,6 @@ int io61_readc(io61_file* f) {
     }
     unsigned char ch = f->cbuf[f->pos_tag - f->tag];
     ++f->pos_tag;
-    f->mutex.unlock();
     return ch;
 }
 
@@ -162,8 +293,7 @@ int io61_readc(io61_file* f) {
 ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
     assert(!f->positioned);
     size_t nread = 0;
-    // Modify the cache contents and/or position tag here
-    f->mutex.lock();
+    io61_stream_guard guard(f);
     while (nread != sz) {
         if (f->pos_tag == f->end_tag) {
             int r = io61_fill(f);
@@ -178,8 +308,7 @@ ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
         memcpy(&buf[nread], &f->cbuf[f->pos_tag - f->tag], ncopy);
         nread += ncopy;
         f->pos_tag += ncopy;
-    }     
-    f->mutex.unlock();
+    }
     return nread;
 }
 
@@ -190,7 +319,7 @@ ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
 
 int io61_writec(io61_file* f, int c) {
     assert(!f->positioned);
-    f->mutex.lock();
+    io61_stream_guard guard(f);
     if (f->pos_tag == f->tag + f->cbufsz) {
         int r = io61_flush(f);
         if (r == -1) {
@@ -201,7 +330,6 @@ int io61_writec(io61_file* f, int c) {
     ++f->pos_tag;
     ++f->end_tag;
     f->dirty = true;
-    f->mutex.unlock();
     return 0;
 }
 
@@ -216,7 +344,7 @@ int io61_writec(io61_file* f, int c) {
 ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
     assert(!f->positioned);
     size_t nwritten = 0;
-    f->mutex.lock();
+    io61_stream_guard guard(f);
     while (nwritten != sz) {
         if (f->end_tag == f->tag + f->cbufsz) {
             int r = io61_flush(f);
@@ -234,7 +362,6 @@ ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
         f->dirty = true;
         nwritten += ncopy;
     }
-    f->mutex.unlock();
     return nwritten;
 }
 
@@ -248,13 +375,15 @@ ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
 //    data cached for reading and seeks to the logical file position.
 
 static int io61_flush_dirty(io61_file* f);
-static int io61_flush_dirty_positioned(io61_file* f);
+static int io61_flush_positioned(io61_file* f);
 static int io61_flush_clean(io61_file* f);
 
 int io61_flush(io61_file* f) {
-    if (f->dirty && f->positioned) {
-        return io61_flush_dirty_positioned(f);
-    } else if (f->dirty) {
+    if (f->positioned) {
+        return io61_flush_positioned(f);
+    }
+    io61_stream_guard guard(f);
+    if (f->dirty) {
         return io61_flush_dirty(f);
     } else {
         return io61_flush_clean(f);
@@ -267,7 +396,7 @@ int io61_flush(io61_file* f) {
 //    Returns 0 on success and -1 on failure.
 
 int io61_seek(io61_file* f, off_t off) {
-    f->mutex.lock();
+    io61_stream_guard guard(f);
     int r = io61_flush(f);
     if (r == -1) {
         return -1;
@@ -276,9 +405,16 @@ int io61_seek(io61_file* f, off_t off) {
     if (roff == -1) {
         return -1;
     }
+    if (f->positioned) {
+        // drop positioned-mode blocks so they cannot go stale
+        for (size_t i = 0; i != f->npslots; ++i) {
+            io61_pslot& slot = f->pslots[i];
+            std::lock_guard slot_guard(slot.latch);
+            slot.tag = slot.end_tag = -1;
+        }
+        f->positioned = false;
+    }
     f->tag = f->pos_tag = f->end_tag = off;
-    f->positioned = false;
-    f->mutex.unlock();
     return 0;
 }
 
@@ -287,12 +423,14 @@ int io61_seek(io61_file* f, off_t off) {
 
 // io61_fill(f)
 //    Fill the cache by reading from the file. Returns 0 on success,
-//    -1 on error. Used only for non-positioned files.
+//    -1 on error. Used only for non-positioned files; the stream lock
+//    must be held.
 
 static int io61_fill(io61_file* f) {
-    assert(f->tag == f->end_tag && f->pos_tag == f->end_tag);
+    assert(f->pos_tag == f->end_tag && !f->dirty);
+    // Reset the cache to empty.
+    f->tag = f->pos_tag = f->end_tag;
     ssize_t nr;
-    f->mutex.lock();
     while (true) {
         nr = read(f->fd, f->cbuf, f->cbufsz);
         if (nr >= 0) {
@@ -302,7 +440,6 @@ static int io61_fill(io61_file* f) {
         }
     }
     f->end_tag += nr;
-    f->mutex.unlock();
     return 0;
 }
 
@@ -314,7 +451,6 @@ static int io61_flush_dirty(io61_file* f) {
     // Called when `f`’s cache is dirty and not positioned.
     // Uses `write`; assumes that the initial file position equals `f->tag`.
     off_t flush_tag = f->tag;
-    f->mutex.lock();
     while (flush_tag != f->end_tag) {
         ssize_t nw = write(f->fd, &f->cbuf[flush_tag - f->tag],
                            f->end_tag - flush_tag);
@@ -326,45 +462,53 @@ static int io61_flush_dirty(io61_file* f) {
     }
     f->dirty = false;
     f->tag = f->pos_tag = f->end_tag;
-    f->mutex.unlock();
     return 0;
 }
 
-static int io61_flush_dirty_positioned(io61_file* f) {
-    // Called when `f`’s cache is dirty and positioned.
-    // Uses `pwrite`; does not change file position.
-    f->mutex.lock();
-    off_t flush_tag = f->tag;
-    while (flush_tag != f->end_tag) {
-        ssize_t nw = pwrite(f->fd, &f->cbuf[flush_tag - f->tag],
-                            f->end_tag - flush_tag, flush_tag);
-        if (nw >= 0) {
-            flush_tag += nw;
-        } else if (errno != EINTR && errno != EINVAL) {
-            return -1;
+static int io61_pslot_flush(io61_file* f, io61_pslot& slot);
+
+static int io61_flush_positioned(io61_file* f) {
+    // Called when `f` is in positioned mode. Waits for background
+    // writeback, then writes back every dirty slot; uses `pwrite`, so
+    // does not change file position. Reports any background write error.
+    int r = 0;
+    for (size_t i = 0; i != f->npslots; ++i) {
+        io61_pslot& slot = f->pslots[i];
+        std::unique_lock guard(slot.latch);
+        while (slot.wb) {
+            slot.wb_cv.wait(guard);
+        }
+        if (io61_pslot_flush(f, slot) == -1) {
+            r = -1;
         }
     }
-    f->dirty = false;
-    f->mutex.unlock();
-    return 0;
+    std::lock_guard wb_guard(f->wb_mutex);
+    if (f->wb_error != 0) {
+        errno = f->wb_error;
+        f->wb_error = 0;
+        r = -1;
+    }
+    return r;
 }
 
 static int io61_flush_clean(io61_file* f) {
     // Called when `f`’s cache is clean.
-    f->mutex.lock();
-    if (!f->positioned && f->seekable) {
+    if (f->seekable) {
         if (lseek(f->fd, f->pos_tag, SEEK_SET) == -1) {
             return -1;
         }
         f->tag = f->end_tag = f->pos_tag;
     }
-    f->mutex.unlock();
     return 0;
 }
 
 
 
 // POSITIONED I/O FUNCTIONS
+//    Positioned reads and writes go through `f->pslots`. Each call
+//    touches one slot and holds only that slot's latch, so threads
+//    working on different blocks never wait for each other; the range
+//    locks are what order conflicting transactions.
 
 // io61_pread(f, buf, sz, off)
 //    Read up to `sz` bytes from `f` into `buf`, starting at offset `off`.
@@ -373,20 +517,22 @@ static int io61_flush_clean(io61_file* f) {
 //    This function can only be called when `f` was opened in read/write
 //    more (O_RDWR).
 
-static int io61_pfill(io61_file* f, off_t off);
+static io61_pslot& io61_pslot_find(io61_file* f, off_t off);
+static int io61_pslot_fill(io61_file* f, io61_pslot& slot,
+                           std::unique_lock<std::mutex>& guard, off_t off);
 
 ssize_t io61_pread(io61_file* f, unsigned char* buf, size_t sz,
                    off_t off) {
-    f->mutex.lock();
-    if (!f->positioned || off < f->tag || off >= f->end_tag) {
-        if (io61_pfill(f, off) == -1) {
-            return -1;
-        }
+    io61_pslot& slot = io61_pslot_find(f, off);
+    std::unique_lock guard(slot.latch);
+    if (io61_pslot_fill(f, slot, guard, off) == -1) {
+        return -1;
+    }
+    if (off >= slot.end_tag) {
+        return 0;
     }
-    size_t nleft = f->end_tag - off;
-    size_t ncopy = std::min(sz, nleft);
-    memcpy(buf, &f->cbuf[off - f->tag], ncopy);
-    f->mutex.unlock();
+    size_t ncopy = std::min(sz, size_t(slot.end_tag - off));
+    memcpy(buf, &slot.buf[off - slot.tag], ncopy);
     return ncopy;
 }
 
@@ -400,47 +546,793 @@ ssize_t io61_pread(io61_file* f, unsigned char* buf, size_t sz,
 
 ssize_t io61_pwrite(io61_file* f, const unsigned char* buf, size_t sz,
                     off_t off) {
-    f->mutex.lock();
-    if (!f->positioned || off < f->tag || off >= f->end_tag) {
-        if (io61_pfill(f, off) == -1) {
-            return -1;
-        }
+    io61_pslot& slot = io61_pslot_find(f, off);
+    std::unique_lock guard(slot.latch);
+    if (io61_pslot_fill(f, slot, guard, off) == -1) {
+        return -1;
     }
-    size_t nleft = f->end_tag - off;
-    size_t ncopy = std::min(sz, nleft);
-    memcpy(&f->cbuf[off - f->tag], buf, ncopy);
-    f->dirty = true;
-    f->mutex.unlock();
+    if (off > slot.end_tag) {
+        // writing past end of file: the gap reads as zeros
+        memset(&slot.buf[slot.end_tag - slot.tag], 0, off - slot.end_tag);
+    }
+    size_t ncopy = std::min(sz, size_t(slot.tag + slot.bufsz - off));
+    memcpy(&slot.buf[off - slot.tag], buf, ncopy);
+    slot.end_tag = std::max(slot.end_tag, off_t(off + ncopy));
+    slot.dirty = true;
     return ncopy;
 }
 
 
-// io61_pfill(f, off)
-//    Fill the single-slot cache with data including offset `off`.
-//    The handout code rounds `off` down to a multiple of 8192.
+// io61_pslot_find(f, off)
+//    Returns the slot that caches offset `off`, allocating the slots on
+//    `f`'s first positioned access.
+
+static io61_pslot& io61_pslot_find(io61_file* f, off_t off) {
+    if (!f->positioned) {
+        std::call_once(f->pslots_once, [f] () {
+            f->pslots = std::make_unique<io61_pslot[]>(f->npslots);
+        });
+        f->positioned = true;
+    }
+    return f->pslots[(off / io61_pslot::bufsz) % f->npslots];
+}
+
+
+// io61_pslot_fill(f, slot, guard, off)
+//    Makes `slot` hold the block containing offset `off`, evicting the
+//    block it held before. `guard` must hold `slot.latch`.
 
-static int io61_pfill(io61_file* f, off_t off) {
+static int io61_pslot_evict(io61_file* f, io61_pslot& slot,
+                            std::unique_lock<std::mutex>& guard);
+
+static int io61_pslot_fill(io61_file* f, io61_pslot& slot,
+                           std::unique_lock<std::mutex>& guard, off_t off) {
     assert(f->mode == O_RDWR);
-    f->mutex.lock();
-    if (f->dirty && io61_flush(f) == -1) {
+    off_t tag = off - (off % slot.bufsz);
+    if (slot.tag == tag) {
+        return 0;
+    }
+    if (slot.dirty && io61_pslot_evict(f, slot, guard) == -1) {
         return -1;
     }
-
-    off = off - (off % 8192);
-    ssize_t nr = pread(f->fd, f->cbuf, f->cbufsz, off);
+    if (slot.wb && slot.wb->tag == tag) {
+        // block is still queued for writeback; the file is not current
+        memcpy(slot.buf, slot.wb->buf, slot.wb->end_tag - tag);
+        slot.tag = tag;
+        slot.end_tag = slot.wb->end_tag;
+        return 0;
+    }
+    ssize_t nr;
+    do {
+        nr = pread(f->fd, slot.buf, slot.bufsz, tag);
+    } while (nr == -1 && errno == EINTR);
     if (nr == -1) {
+        slot.tag = slot.end_tag = -1;
         return -1;
     }
-    f->tag = off;
-    f->end_tag = off + nr;
-    f->positioned = true;
-    f->mutex.unlock();
+    slot.tag = tag;
+    slot.end_tag = tag + nr;
+    return 0;
+}
+
+
+// io61_pwrite_block(f, buf, tag, end_tag)
+//    Writes `buf`, which holds file bytes `[tag, end_tag)`, to the file.
+//    Returns 0 on success and -1 on error.
+
+static int io61_pwrite_block(io61_file* f, const unsigned char* buf,
+                             off_t tag, off_t end_tag) {
+    off_t flush_tag = tag;
+    while (flush_tag != end_tag) {
+        ssize_t nw = pwrite(f->fd, &buf[flush_tag - tag],
+                            end_tag - flush_tag, flush_tag);
+        if (nw >= 0) {
+            flush_tag += nw;
+        } else if (errno != EINTR && errno != EINVAL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// io61_pslot_flush(f, slot)
+//    Writes `slot` back to the file if it is dirty. `slot.latch` must be
+//    held.
+
+static int io61_pslot_flush(io61_file* f, io61_pslot& slot) {
+    if (slot.dirty
+        && io61_pwrite_block(f, slot.buf, slot.tag, slot.end_tag) == -1) {
+        return -1;
+    }
+    slot.dirty = false;
+    return 0;
+}
+
+
+// io61_pslot_evict(f, slot, guard)
+//    Hands the dirty block in `slot` to the writeback thread, starting
+//    the thread if necessary, so the caller need not wait for the write.
+//    Writes the block directly if every writeback block is in use.
+//    `guard` must hold `slot.latch`.
+
+static void io61_writeback(io61_file* f);
+
+static int io61_pslot_evict(io61_file* f, io61_pslot& slot,
+                            std::unique_lock<std::mutex>& guard) {
+    // the slot's previous eviction must land first
+    while (slot.wb) {
+        slot.wb_cv.wait(guard);
+    }
+    io61_wbblock* wb = nullptr;
+    {
+        std::lock_guard wb_guard(f->wb_mutex);
+        if (!f->wb_thread.joinable()) {
+            f->wbblocks.resize(f->nwbblocks);
+            for (auto& b : f->wbblocks) {
+                f->wb_free.push_back(&b);
+            }
+            f->wb_thread = std::thread(io61_writeback, f);
+        }
+        if (!f->wb_free.empty()) {
+            wb = f->wb_free.back();
+            f->wb_free.pop_back();
+        }
+    }
+    if (!wb) {
+        return io61_pslot_flush(f, slot);
+    }
+    wb->slot = &slot;
+    wb->tag = slot.tag;
+    wb->end_tag = slot.end_tag;
+    memcpy(wb->buf, slot.buf, slot.end_tag - slot.tag);
+    slot.wb = wb;
+    slot.dirty = false;
+    {
+        std::lock_guard wb_guard(f->wb_mutex);
+        f->wb_queue.push_back(wb);
+    }
+    f->wb_cv.notify_one();
     return 0;
 }
 
 
+// io61_writeback(f)
+//    Body of the writeback thread. Writes queued blocks in order, then
+//    releases each one from its slot. A failed write is remembered and
+//    reported by the next `io61_flush`.
+
+static void io61_writeback(io61_file* f) {
+    std::unique_lock guard(f->wb_mutex);
+    while (true) {
+        if (f->wb_queue.empty()) {
+            if (f->wb_stop) {
+                return;
+            }
+            f->wb_cv.wait(guard);
+            continue;
+        }
+        io61_wbblock* wb = f->wb_queue.front();
+        f->wb_queue.pop_front();
+        guard.unlock();
+
+        int r = io61_pwrite_block(f, wb->buf, wb->tag, wb->end_tag);
+        int err = errno;
+        {
+            std::lock_guard slot_guard(wb->slot->latch);
+            wb->slot->wb = nullptr;
+        }
+        wb->slot->wb_cv.notify_all();
+
+        guard.lock();
+        if (r == -1) {
+            f->wb_error = err;
+        }
+        f->wb_free.push_back(wb);
+    }
+}
+
+
+// io61_writeback_stop(f)
+//    Stops the writeback thread, if any, after it drains its queue.
+
+static void io61_writeback_stop(io61_file* f) {
+    {
+        std::lock_guard guard(f->wb_mutex);
+        f->wb_stop = true;
+    }
+    f->wb_cv.notify_all();
+    if (f->wb_thread.joinable()) {
+        f->wb_thread.join();
+    }
+}
+
+
 
 // FILE LOCKING FUNCTIONS
+//    Locks are kept in `f->locks`, a map of disjoint segments ordered by
+//    offset. Locking or unlocking a range splits the segments at the
+//    range's endpoints, updates the segments in between, and then merges
+//    neighbors whose state matches again. Each operation costs O(log n)
+//    plus the number of segments the range covers; ranges nobody has
+//    locked cost nothing.
+//
+//    Any number of threads may hold overlapping `LOCK_SH` locks; a
+//    `LOCK_EX` lock excludes every other thread. A thread may lock bytes
+//    it already holds, including upgrading a shared lock to exclusive
+//    once it is the only shared holder.
+//
+//    Blocked requests wait in `f->lock_waiters` in arrival order. A
+//    thread holding no locks also waits behind any earlier queued request
+//    it conflicts with, so neither readers nor writers starve. Threads
+//    that already hold locks skip that check: the queued request might be
+//    waiting for them, and waiting behind it could deadlock. Unlocking
+//    hands the lock directly to queued requests that overlap the released
+//    bytes and can now proceed, in FIFO order, and wakes only them.
+
+// io61_lock_first(f, off)
+//    Returns the first segment in `f` that ends after `off`.
+//    `f->lock_mutex` must be held.
+
+static io61_lockmap::iterator io61_lock_first(io61_file* f, off_t off) {
+    auto it = f->locks.upper_bound(off);
+    if (it != f->locks.begin() && std::prev(it)->second.end > off) {
+        --it;
+    }
+    return it;
+}
+
+
+// io61_lockseg_sharer(seg, owner)
+//    Returns the position in `seg.sharers` where `owner` is or belongs.
+
+static std::vector<io61_sharer>::iterator io61_lockseg_sharer(
+        io61_lockseg& seg, std::thread::id owner) {
+    return std::lower_bound(seg.sharers.begin(), seg.sharers.end(), owner,
+        [] (const io61_sharer& s, std::thread::id o) {
+            return s.owner < o;
+        });
+}
+
+
+// io61_lockseg_holds(seg, owner)
+//    Returns true iff `owner` holds any lock on segment `seg`.
+
+static bool io61_lockseg_holds(io61_lockseg& seg, std::thread::id owner) {
+    if (seg.locked > 0 && seg.owner == owner) {
+        return true;
+    }
+    auto it = io61_lockseg_sharer(seg, owner);
+    return it != seg.sharers.end() && it->owner == owner;
+}
+
+
+// io61_lockseg_add(seg, owner, locktype)
+//    Records one more `locktype` lock by `owner` on segment `seg`.
+
+static void io61_lockseg_add(io61_lockseg& seg, std::thread::id owner,
+                             int locktype) {
+    if (locktype == LOCK_EX) {
+        seg.owner = owner;
+        ++seg.locked;
+    } else {
+        auto it = io61_lockseg_sharer(seg, owner);
+        if (it != seg.sharers.end() && it->owner == owner) {
+            ++it->locked;
+        } else {
+            seg.sharers.insert(it, io61_sharer{owner, 1});
+        }
+    }
+}
+
+
+// io61_lockseg_remove(seg, owner)
+//    Releases one lock by `owner` on segment `seg`, preferring an
+//    exclusive lock, so that unlocking an upgraded range restores the
+//    shared lock. Returns true iff `owner` no longer holds `seg` in the
+//    released mode, which might let another thread proceed.
+
+static bool io61_lockseg_remove(io61_lockseg& seg, std::thread::id owner) {
+    if (seg.locked > 0 && seg.owner == owner) {
+        if (--seg.locked == 0) {
+            seg.owner = std::thread::id();
+            return true;
+        }
+        return false;
+    }
+    auto it = io61_lockseg_sharer(seg, owner);
+    assert(it != seg.sharers.end() && it->owner == owner);
+    if (--it->locked == 0) {
+        seg.sharers.erase(it);
+        return true;
+    }
+    return false;
+}
+
+
+// io61_lockseg_empty(seg), io61_lockseg_same(a, b)
+//    Segment state tests.
+
+static inline bool io61_lockseg_empty(const io61_lockseg& seg) {
+    return seg.locked == 0 && seg.sharers.empty();
+}
+
+static inline bool io61_lockseg_same(const io61_lockseg& a,
+                                     const io61_lockseg& b) {
+    return a.owner == b.owner
+        && a.locked == b.locked
+        && a.sharers == b.sharers;
+}
+
+
+// io61_lock_count(f, owner, delta)
+//    Adds `delta` to the number of segments `owner` holds in `f`.
+
+static void io61_lock_count(io61_file* f, std::thread::id owner,
+                            int delta) {
+    auto it = f->lock_nheld.try_emplace(owner, 0).first;
+    assert(delta > 0 || it->second >= size_t(-delta));
+    it->second += delta;
+    if (it->second == 0) {
+        f->lock_nheld.erase(it);
+    }
+}
+
+
+// io61_lock_count_holders(f, seg, delta)
+//    Adds `delta` to the held-segment count of every thread holding a
+//    lock on `seg`. Used when `seg` is split off or merged away.
+
+static void io61_lock_count_holders(io61_file* f, const io61_lockseg& seg,
+                                    int delta) {
+    if (seg.locked > 0) {
+        io61_lock_count(f, seg.owner, delta);
+    }
+    for (auto& sh : seg.sharers) {
+        if (seg.locked == 0 || sh.owner != seg.owner) {
+            io61_lock_count(f, sh.owner, delta);
+        }
+    }
+}
+
+
+// io61_lock_add(f, seg, owner, locktype), io61_lock_remove(f, seg, owner)
+//    Like `io61_lockseg_add` and `io61_lockseg_remove`, but also keep
+//    `f->lock_nheld` up to date.
+
+static void io61_lock_add(io61_file* f, io61_lockseg& seg,
+                          std::thread::id owner, int locktype) {
+    if (!io61_lockseg_holds(seg, owner)) {
+        io61_lock_count(f, owner, 1);
+    }
+    io61_lockseg_add(seg, owner, locktype);
+}
+
+static bool io61_lock_remove(io61_file* f, io61_lockseg& seg,
+                             std::thread::id owner) {
+    bool freed = io61_lockseg_remove(seg, owner);
+    if (!io61_lockseg_holds(seg, owner)) {
+        io61_lock_count(f, owner, -1);
+    }
+    return freed;
+}
+
+
+// io61_lock_holds_any(f, owner)
+//    Returns true iff `owner` holds any lock in `f`.
+
+static bool io61_lock_holds_any(io61_file* f, std::thread::id owner) {
+    return f->lock_nheld.find(owner) != f->lock_nheld.end();
+}
+
+
+// io61_ranges_overlap(a, na, b, nb)
+//    Returns true iff some range in `a[0..na-1]` overlaps some range in
+//    `b[0..nb-1]`.
+
+static bool io61_ranges_overlap(const io61_range* a, size_t na,
+                                const io61_range* b, size_t nb) {
+    for (size_t i = 0; i != na; ++i) {
+        for (size_t j = 0; j != nb; ++j) {
+            if (a[i].start < b[j].start + b[j].len
+                && b[j].start < a[i].start + a[i].len) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+
+// io61_lock_conflicts(f, ranges, n, locktype, owner, queuepos)
+//    Returns true iff `owner` cannot lock all of `ranges[0..n-1]` in mode
+//    `locktype` right now, either because another thread holds a
+//    conflicting lock or because `owner` holds no locks and a conflicting
+//    request queued before `queuepos` in `f->lock_waiters` must go first.
+//    Overlapping locks in the same thread are fine; the overlapping
+//    segments are simply locked more than once.
+
+static bool io61_lock_conflicts(io61_file* f, const io61_range* ranges,
+                                size_t n, int locktype,
+                                std::thread::id owner,
+                                io61_waitqueue::iterator queuepos) {
+    for (size_t i = 0; i != n; ++i) {
+        off_t end = ranges[i].start + ranges[i].len;
+        for (auto it = io61_lock_first(f, ranges[i].start);
+             it != f->locks.end() && it->first < end;
+             ++it) {
+            io61_lockseg& seg = it->second;
+            if ((seg.locked > 0 && seg.owner != owner)
+                || (locktype == LOCK_EX
+                    && !seg.sharers.empty()
+                    && (seg.sharers.size() > 1
+                        || seg.sharers[0].owner != owner))) {
+                return true;
+            }
+        }
+    }
+    // threads holding no locks defer to earlier requests
+    for (auto it = f->lock_waiters.begin(); it != queuepos; ++it) {
+        io61_lockwaiter* w = *it;
+        if ((locktype == LOCK_EX || w->locktype == LOCK_EX)
+            && io61_ranges_overlap(ranges, n, w->ranges, w->nranges)) {
+            return !io61_lock_holds_any(f, owner);
+        }
+    }
+    return false;
+}
+
+
+// io61_lock_blockers(f, ranges, n, locktype, owner, blockers)
+//    Appends to `blockers` every other thread holding a lock that keeps
+//    `owner` from locking `ranges[0..n-1]` in mode `locktype`.
+
+static void io61_lock_blockers(io61_file* f, const io61_range* ranges,
+                               size_t n, int locktype, std::thread::id owner,
+                               std::vector<std::thread::id>& blockers) {
+    for (size_t i = 0; i != n; ++i) {
+        off_t end = ranges[i].start + ranges[i].len;
+        for (auto it = io61_lock_first(f, ranges[i].start);
+             it != f->locks.end() && it->first < end;
+             ++it) {
+            io61_lockseg& seg = it->second;
+            if (seg.locked > 0 && seg.owner != owner) {
+                blockers.push_back(seg.owner);
+            }
+            if (locktype == LOCK_EX) {
+                for (auto& sh : seg.sharers) {
+                    if (sh.owner != owner) {
+                        blockers.push_back(sh.owner);
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+// io61_lock_deadlocks(f, ranges, n, locktype)
+//    Returns true iff blocking the calling thread on this request would
+//    close a cycle in the wait-for graph. The graph has an edge from each
+//    queued request to every thread holding a lock that blocks it.
+//    Queue-order waits are left out: only threads holding no locks wait
+//    for the queue, and nothing can be waiting for such a thread, so
+//    those waits are never part of a cycle. Since the graph is checked
+//    every time a thread blocks, any cycle runs through the thread that
+//    blocked last, which is the youngest waiter and the one that fails.
+//    Only locks on `f` are considered.
+
+static bool io61_lock_deadlocks(io61_file* f, const io61_range* ranges,
+                                size_t n, int locktype) {
+    auto me = std::this_thread::get_id();
+    if (!io61_lock_holds_any(f, me)) {
+        return false;
+    }
+    std::vector<std::thread::id> todo, seen;
+    io61_lock_blockers(f, ranges, n, locktype, me, todo);
+    while (!todo.empty()) {
+        auto t = todo.back();
+        todo.pop_back();
+        if (t == me) {
+            return true;
+        } else if (std::find(seen.begin(), seen.end(), t) != seen.end()) {
+            continue;
+        }
+        seen.push_back(t);
+        for (auto w : f->lock_waiters) {
+            if (w->owner == t) {
+                io61_lock_blockers(f, w->ranges, w->nranges, w->locktype,
+                                   t, todo);
+            }
+        }
+    }
+    return false;
+}
+
+
+// io61_lock_split(f, off)
+//    Splits the segment that straddles `off`, if any, so that some
+//    segment boundary falls at `off`.
+
+static void io61_lock_split(io61_file* f, off_t off) {
+    auto it = io61_lock_first(f, off);
+    if (it != f->locks.end() && it->first < off) {
+        io61_lockseg tail = it->second;
+        it->second.end = off;
+        io61_lock_count_holders(f, tail, 1);
+        f->locks.emplace_hint(std::next(it), off, std::move(tail));
+    }
+}
+
+
+// io61_lock_join(f, off)
+//    Merges the segments on either side of `off` if they are adjacent and
+//    their states match. Locking or unlocking a range changes every
+//    segment inside it the same way, so only the range's endpoints can
+//    create new opportunities to merge.
+
+static void io61_lock_join(io61_file* f, off_t off) {
+    auto it = f->locks.find(off);
+    if (it == f->locks.end() || it == f->locks.begin()) {
+        return;
+    }
+    auto prev = std::prev(it);
+    if (prev->second.end == off
+        && io61_lockseg_same(prev->second, it->second)) {
+        prev->second.end = it->second.end;
+        io61_lock_count_holders(f, it->second, -1);
+        f->locks.erase(it);
+    }
+}
+
+
+// io61_lock_acquire(f, start, end, locktype, owner)
+//    Records a `locktype` lock on `[start, end)` for `owner`. Must only be
+//    called when `io61_lock_conflicts` is false.
+
+static void io61_lock_acquire(io61_file* f, off_t start, off_t end,
+                              int locktype, std::thread::id owner) {
+    auto it = io61_lock_first(f, start);
+    if (it == f->locks.end() || it->first >= end) {
+        // common case: nothing in the range is locked yet
+        it = f->locks.emplace_hint(it, start, io61_lockseg(end));
+        io61_lock_add(f, it->second, owner, locktype);
+    } else {
+        io61_lock_split(f, start);
+        io61_lock_split(f, end);
+        it = f->locks.lower_bound(start);
+        off_t off = start;
+        while (off != end) {
+            if (it == f->locks.end() || it->first != off) {
+                // fill the unlocked gap before the next segment
+                off_t gap_end = end;
+                if (it != f->locks.end() && it->first < end) {
+                    gap_end = it->first;
+                }
+                it = f->locks.emplace_hint(it, off, io61_lockseg(gap_end));
+            }
+            io61_lock_add(f, it->second, owner, locktype);
+            off = it->second.end;
+            ++it;
+        }
+    }
+    io61_lock_join(f, start);
+    io61_lock_join(f, end);
+}
+
+
+// io61_lock_release(f, first, start, end, owner)
+//    Releases one lock by `owner` on each byte in `[start, end)`, which
+//    `owner` must hold. `first` is `io61_lock_first(f, start)`. Returns
+//    true iff some byte became available to other threads.
+
+static bool io61_lock_release(io61_file* f, io61_lockmap::iterator first,
+                              off_t start, off_t end,
+                              std::thread::id owner) {
+    bool freed = false;
+    if (first->first == start && first->second.end == end) {
+        // common case: the range is exactly one segment
+        freed = io61_lock_remove(f, first->second, owner);
+        if (io61_lockseg_empty(first->second)) {
+            f->locks.erase(first);
+            return freed;
+        }
+    } else {
+        io61_lock_split(f, start);
+        io61_lock_split(f, end);
+        auto it = f->locks.lower_bound(start);
+        while (it != f->locks.end() && it->first < end) {
+            freed = io61_lock_remove(f, it->second, owner) || freed;
+            if (io61_lockseg_empty(it->second)) {
+                it = f->locks.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    io61_lock_join(f, start);
+    io61_lock_join(f, end);
+    return freed;
+}
+
+
+// io61_lock_holds_all(f, first, start, end, owner)
+//    Returns true iff `owner` holds a lock on every byte in `[start, end)`.
+//    `first` is `io61_lock_first(f, start)`.
+
+static bool io61_lock_holds_all(io61_file* f, io61_lockmap::iterator first,
+                                off_t start, off_t end,
+                                std::thread::id owner) {
+    off_t off = start;
+    for (auto it = first; off < end; ++it) {
+        if (it == f->locks.end()
+            || it->first > off
+            || !io61_lockseg_holds(it->second, owner)) {
+            return false;
+        }
+        off = it->second.end;
+    }
+    return true;
+}
+
+
+// io61_lock_wake(f, ranges, n)
+//    Called after bytes in `ranges[0..n-1]` were released. Grants the lock
+//    to each queued request, in FIFO order, that overlaps a changed range
+//    and no longer conflicts, and wakes its thread. A granted request
+//    changes its own ranges too, which may unblock requests behind it.
+
+static void io61_lock_wake(io61_file* f, const io61_range* ranges,
+                           size_t n) {
+    std::vector<io61_range> changed(ranges, ranges + n);
+    auto it = f->lock_waiters.begin();
+    while (it != f->lock_waiters.end()) {
+        io61_lockwaiter* w = *it;
+        if (io61_ranges_overlap(w->ranges, w->nranges,
+                                changed.data(), changed.size())
+            && !io61_lock_conflicts(f, w->ranges, w->nranges, w->locktype,
+                                    w->owner, it)) {
+            for (size_t i = 0; i != w->nranges; ++i) {
+                const io61_range& r = w->ranges[i];
+                io61_lock_acquire(f, r.start, r.start + r.len,
+                                  w->locktype, w->owner);
+            }
+            changed.insert(changed.end(), w->ranges, w->ranges + w->nranges);
+            it = f->lock_waiters.erase(it);
+            w->granted = true;
+            w->cv.notify_one();
+        } else {
+            ++it;
+        }
+    }
+}
+
+
+// io61_lock_ranges(f, ranges, n, locktype, block)
+//    Locks every range in `ranges[0..n-1]`, which must be sorted,
+//    nonempty, and disjoint, in a single step: either all of them are
+//    acquired or none are. If `block` is false, returns -1 at once on
+//    conflict. Otherwise waits for all the ranges to be free together,
+//    holding none of them while it waits.
+
+static int io61_lock_ranges(io61_file* f, const io61_range* ranges,
+                            size_t n, int locktype, bool block) {
+    assert(locktype == LOCK_EX || locktype == LOCK_SH);
+    auto me = std::this_thread::get_id();
+    std::unique_lock guard(f->lock_mutex);
+    if (io61_lock_conflicts(f, ranges, n, locktype, me,
+                            f->lock_waiters.end())) {
+        if (!block) {
+            return -1;
+        } else if (io61_lock_deadlocks(f, ranges, n, locktype)) {
+            errno = EDEADLK;
+            return -1;
+        }
+        // wait for an unlocking thread to grant the lock
+        io61_lockwaiter w(ranges, n, locktype);
+        f->lock_waiters.push_back(&w);
+        while (!w.granted) {
+            w.cv.wait(guard);
+        }
+        return 0;
+    }
+    for (size_t i = 0; i != n; ++i) {
+        io61_lock_acquire(f, ranges[i].start, ranges[i].start + ranges[i].len,
+                          locktype, me);
+    }
+    return 0;
+}
+
+
+// io61_unlock_ranges(f, ranges, n)
+//    Unlocks every range in `ranges[0..n-1]`, which must be sorted,
+//    nonempty, and disjoint, in a single step. Fails with ENOLCK, and
+//    unlocks nothing, unless the caller holds every byte.
+
+static int io61_unlock_ranges(io61_file* f, const io61_range* ranges,
+                              size_t n) {
+    auto me = std::this_thread::get_id();
+    std::unique_lock guard(f->lock_mutex);
+    auto first = f->locks.end();
+    for (size_t i = 0; i != n; ++i) {
+        auto it = io61_lock_first(f, ranges[i].start);
+        if (!io61_lock_holds_all(f, it, ranges[i].start,
+                                 ranges[i].start + ranges[i].len, me)) {
+            errno = ENOLCK;
+            return -1;
+        }
+        if (i == 0) {
+            first = it;
+        }
+    }
+    bool freed = false;
+    for (size_t i = 0; i != n; ++i) {
+        // releasing a range can merge segments that later ranges start in
+        if (i != 0) {
+            first = io61_lock_first(f, ranges[i].start);
+        }
+        freed = io61_lock_release(f, first, ranges[i].start,
+                                  ranges[i].start + ranges[i].len, me)
+            || freed;
+    }
+    if (freed && !f->lock_waiters.empty()) {
+        io61_lock_wake(f, ranges, n);
+    }
+    return 0;
+}
+
+
+// io61_ranges_normalize(ranges, n, out)
+//    Stores `ranges[0..n-1]` into `out` sorted by offset, without empty
+//    ranges, and with overlapping or adjacent ranges merged. `out` must
+//    have room for `n` ranges. Returns the number of ranges stored.
+
+static size_t io61_ranges_normalize(const io61_range* ranges, size_t n,
+                                    io61_range* out) {
+    size_t nout = 0;
+    for (size_t i = 0; i != n; ++i) {
+        assert(ranges[i].start >= 0 && ranges[i].len >= 0);
+        if (ranges[i].len > 0) {
+            out[nout] = ranges[i];
+            ++nout;
+        }
+    }
+    std::sort(out, out + nout, [] (const io61_range& a, const io61_range& b) {
+        return a.start < b.start;
+    });
+    size_t nmerged = 0;
+    for (size_t i = 0; i != nout; ++i) {
+        io61_range* last = nmerged ? &out[nmerged - 1] : nullptr;
+        if (last && out[i].start <= last->start + last->len) {
+            off_t end = std::max(last->start + last->len,
+                                 out[i].start + out[i].len);
+            last->len = end - last->start;
+        } else {
+            out[nmerged] = out[i];
+            ++nmerged;
+        }
+    }
+    return nmerged;
+}
+
+
+// io61_ranges_buffer
+//    Scratch space for normalized ranges; small requests, such as the
+//    two accounts of a transfer, need no heap allocation.
+
+struct io61_ranges_buffer {
+    io61_range small[8];
+    std::vector<io61_range> large;
+
+    io61_range* get(size_t n) {
+        if (n <= 8) {
+            return small;
+        }
+        large.resize(n);
+        return large.data();
+    }
+};
+
 
 // io61_try_lock(f, start, len, locktype)
 //    Attempts to acquire a lock on offsets `[start, len)` in file `f`.
@@ -451,33 +1343,12 @@ static int io61_pfill(io61_file* f, off_t off) {
 //    block: if the lock cannot be acquired, it returns -1 right away.
 
 int io61_try_lock(io61_file* f, off_t start, off_t len, int locktype) {
-    (void) f;
     assert(start >= 0 && len >= 0);
-    assert(locktype == LOCK_EX || locktype == LOCK_SH);
     if (len == 0) {
         return 0;
     }
-    std::unique_lock guard(f->mutex);
-    if (may_overlap_with_other_lock(f, start, len)) {
-        return -1;
-    }
-    for (int ri = file_region(start); ri <= file_region(start + len - 1); ++ri) {
-        // find the index and element for each region.
-        int find_index = find (f->rmap, ri);
-        if(find_index != -1) {
-            return -1;
-        }
-        map_region reg = f->rmap.at(find_index);
-
-        // update local
-        ++reg.locked;
-        reg.owner = std::this_thread::get_id();
-
-        // replace region
-        f->rmap.erase(f->rmap.begin()+find_index);
-        f->rmap.insert(f->rmap.end(),reg);
-    }
-    return 0;
+    io61_range r = {start, len};
+    return io61_lock_ranges(f, &r, 1, locktype, false);
 }
 
 
@@ -489,77 +1360,86 @@ int io61_try_lock(io61_file* f, off_t start, off_t len, int locktype) {
 //    Returns 0 if the lock was acquired and -1 on error. Blocks until
 //    the lock can be acquired; the -1 return value is reserved for true
 //    error conditions, such as EDEADLK (a deadlock was detected).
+//
+//    Deadlock is detected when a request is about to block: if waiting
+//    would complete a cycle of threads each waiting for locks held by the
+//    next, this request fails with EDEADLK instead. The caller should
+//    release the locks it holds and retry.
 
 int io61_lock(io61_file* f, off_t start, off_t len, int locktype) {
     assert(start >= 0 && len >= 0);
-    assert(locktype == LOCK_EX || locktype == LOCK_SH);
     if (len == 0) {
         return 0;
     }
-    std::unique_lock guard(f->mutex);
-    while (may_overlap_with_other_lock(f, start, len)) {
-        f->cv.wait(guard);
-    }
-    for (int ri = file_region(start); ri <= file_region(start + len - 1); ++ri) {
-        // find the index as well as element for regions
-        int find_index = find (f->rmap, ri);
-        assert(find_index != -1); 
-        map_region reg = f->rmap.at(find_index);
-
-        // update reg
-        ++reg.locked;
-        reg.owner = std::this_thread::get_id();
-
-        // replace region
-        f->rmap.erase(f->rmap.begin()+find_index);
-        f->rmap.insert(f->rmap.end(),reg);
-    }
-    return 0;
+    io61_range r = {start, len};
+    return io61_lock_ranges(f, &r, 1, locktype, true);
 }
 
 
 // io61_unlock(f, start, len)
 //    Release the lock on offsets `[start,len)` in file `f`.
 //    Returns 0 on success and -1 on error.
+//
+//    If the calling thread holds both exclusive and shared locks on a
+//    byte, the exclusive lock is released first.
 
 int io61_unlock(io61_file* f, off_t start, off_t len) {
-    (void) f;
     assert(start >= 0 && len >= 0);
     if (len == 0) {
         return 0;
     }
-    std::unique_lock guard(f->mutex);
-    for (int ri = file_region(start); ri <= file_region(start + len - 1); ++ri) {
-        // find the index
-        int find_index = find (f->rmap, ri);
-        if (find_index == -1) {
-            return -1;
-        }
-        //find elements for regions
-        map_region reg = f->rmap.at(find_index);
+    io61_range r = {start, len};
+    return io61_unlock_ranges(f, &r, 1);
+}
 
-        if (reg.owner != std::this_thread::get_id()) {
-            return -1;
-        }
-        if (reg.locked == 0) {
-            return -1;
-        }
 
-        //update reg
-        --reg.locked;
+// io61_try_lock_many(f, ranges, n, locktype)
+// io61_lock_many(f, ranges, n, locktype)
+//    Lock all of `ranges[0..n-1]` in file `f` atomically: either every
+//    range is acquired or none is. The ranges may be given in any order
+//    and may overlap; they are sorted and merged first. `io61_try_lock_many`
+//    returns -1 right away if any range conflicts. `io61_lock_many` waits
+//    until every range is free at once, holding none of them in the
+//    meantime, so callers that take all their locks this way need no lock
+//    ordering and cannot deadlock with each other. It can still fail with
+//    EDEADLK if the caller already holds other locks.
+
+int io61_try_lock_many(io61_file* f, const io61_range* ranges, size_t n,
+                       int locktype) {
+    io61_ranges_buffer buf;
+    io61_range* norm = buf.get(n);
+    n = io61_ranges_normalize(ranges, n, norm);
+    if (n == 0) {
+        return 0;
+    }
+    return io61_lock_ranges(f, norm, n, locktype, false);
+}
 
-        f->rmap.erase(f->rmap.begin()+find_index);
+int io61_lock_many(io61_file* f, const io61_range* ranges, size_t n,
+                   int locktype) {
+    io61_ranges_buffer buf;
+    io61_range* norm = buf.get(n);
+    n = io61_ranges_normalize(ranges, n, norm);
+    if (n == 0) {
+        return 0;
+    }
+    return io61_lock_ranges(f, norm, n, locktype, true);
+}
 
-        // region is fully unlocked.
-        // otherwise only insert new region if locked dne 0
-        if (reg.locked == 0) {
-            f->cv.notify_all();
-        }
-        else {
-            f->rmap.insert(f->rmap.end(),reg);
-        }
+
+// io61_unlock_many(f, ranges, n)
+//    Release the locks on `ranges[0..n-1]`, as acquired by
+//    `io61_lock_many`, in one step. Returns 0 on success and -1 on error;
+//    on error nothing is unlocked.
+
+int io61_unlock_many(io61_file* f, const io61_range* ranges, size_t n) {
+    io61_ranges_buffer buf;
+    io61_range* norm = buf.get(n);
+    n = io61_ranges_normalize(ranges, n, norm);
+    if (n == 0) {
+        return 0;
     }
-    return 0;
+    return io61_unlock_ranges(f, norm, n);
 }
 
 
@@ -36,8 +36,21 @@ int io61_try_lock(io61_file* f, off_t start, off_t len, int locktype);
 int io61_lock(io61_file* f, off_t start, off_t len, int locktype);
 int io61_unlock(io61_file* f, off_t start, off_t len);
 
+struct io61_range {
+    off_t start;
+    off_t len;
+};
+int io61_try_lock_many(io61_file* f, const io61_range* ranges, size_t n,
+                       int locktype);
+int io61_lock_many(io61_file* f, const io61_range* ranges, size_t n,
+                   int locktype);
+int io61_unlock_many(io61_file* f, const io61_range* ranges, size_t n);
+
 int io61_flush(io61_file* f);
 
+void io61_lock_file(io61_file* f);
+void io61_unlock_file(io61_file* f);
+
 int fd_open_check(const char* filename, int mode);
 FILE* stdio_open_check(const char* filename, int mode);
 double monotonic_timestamp();
@@ -67,6 +80,10 @@ struct io61_args {
     int nthreads = 1;                   // `-j`: number of threads
     int ndistinguished_threads = 0;     // `-J`: # distinguished threads
     size_t noperations = 0;             // `-n`: number of operations
+    bool unordered = false;             // `-U`: lock without ordering
+    bool wal = false;                   // `-W`: use write-ahead log
+    bool memory = false;                // `-m`: keep accounts in memory
+    bool optimistic = false;            // `-O`: optimistic transfers
 
     explicit io61_args(const char* opts, size_t block_size = 0);
 